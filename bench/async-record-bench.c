@@ -0,0 +1,273 @@
+/*
+ * Benchmark of the path from `async_record_video` to `video_output`.
+ *
+ * Synthetic frames are fed to the filter callback at a given rate and the
+ * record thread sends them to a `video_output` opened by this program.
+ * Instead of an encoder, a raw video callback receives the frames.
+ * Neither the graphics subsystem nor an encoder is required.
+ */
+
+#include "../src/source-record-async.c"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+const char *obs_module_text(const char *val)
+{
+	return val;
+}
+
+struct bench_args
+{
+	enum video_format format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t fps;
+	int frames;
+	bool direct_output;
+	int copy_threads;
+	int queue_max_frames;
+};
+
+struct bench_output
+{
+	volatile long received;
+	pthread_mutex_t mutex;
+	DARRAY(uint64_t) latencies;
+};
+
+static const struct {
+	const char *name;
+	enum video_format format;
+} formats[] = {
+	{"i420", VIDEO_FORMAT_I420},
+	{"nv12", VIDEO_FORMAT_NV12},
+	{"uyvy", VIDEO_FORMAT_UYVY},
+	{"yuy2", VIDEO_FORMAT_YUY2},
+	{"bgra", VIDEO_FORMAT_BGRA},
+	{"rgba", VIDEO_FORMAT_RGBA},
+#if LIBOBS_API_VER >= MAKE_SEMANTIC_VERSION(28, 0, 0)
+	{"i010", VIDEO_FORMAT_I010},
+	{"p010", VIDEO_FORMAT_P010},
+#endif
+};
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -f FORMAT   i420, nv12, uyvy, yuy2, bgra, rgba, i010, p010 (default: nv12)\n"
+		"  -s WxH      resolution (default: 1920x1080)\n"
+		"  -r FPS      frame rate, 0 to feed as fast as possible (default: 60)\n"
+		"  -n FRAMES   number of frames (default: 600)\n"
+		"  -d          send frames from the video thread\n"
+		"  -t THREADS  threads to copy large frames (default: 1)\n"
+		"  -q FRAMES   maximum queued frames (default: 120)\n",
+		argv0);
+}
+
+static bool parse_args(struct bench_args *args, int argc, char **argv)
+{
+	args->format = VIDEO_FORMAT_NV12;
+	args->width = 1920;
+	args->height = 1080;
+	args->fps = 60;
+	args->frames = 600;
+	args->direct_output = false;
+	args->copy_threads = 1;
+	args->queue_max_frames = 120;
+
+	for (int i = 1; i < argc; i++) {
+		const char *a = argv[i];
+		const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+		if (strcmp(a, "-d") == 0) {
+			args->direct_output = true;
+			continue;
+		}
+		if (!v)
+			return false;
+		i++;
+
+		if (strcmp(a, "-f") == 0) {
+			bool found = false;
+			for (size_t j = 0; j < sizeof(formats) / sizeof(*formats); j++) {
+				if (strcmp(v, formats[j].name) == 0) {
+					args->format = formats[j].format;
+					found = true;
+				}
+			}
+			if (!found)
+				return false;
+		}
+		else if (strcmp(a, "-s") == 0) {
+			if (sscanf(v, "%ux%u", &args->width, &args->height) != 2)
+				return false;
+		}
+		else if (strcmp(a, "-r") == 0)
+			args->fps = (uint32_t)atoi(v);
+		else if (strcmp(a, "-n") == 0)
+			args->frames = atoi(v);
+		else if (strcmp(a, "-t") == 0)
+			args->copy_threads = atoi(v);
+		else if (strcmp(a, "-q") == 0)
+			args->queue_max_frames = atoi(v);
+		else
+			return false;
+	}
+
+	return args->width > 0 && args->height > 0 && args->frames > 0;
+}
+
+static void raw_video_cb(void *param, struct video_data *frame)
+{
+	struct bench_output *out = param;
+	uint64_t now = os_gettime_ns();
+	uint64_t latency = now > frame->timestamp ? now - frame->timestamp : 0;
+
+	pthread_mutex_lock(&out->mutex);
+	da_push_back(out->latencies, &latency);
+	pthread_mutex_unlock(&out->mutex);
+
+	os_atomic_inc_long(&out->received);
+}
+
+static void *bench_record_thread(void *data)
+{
+	struct async_record *s = data;
+	os_set_thread_name("asrec-bench");
+	thread_main_loop(s);
+	release_last_frame(s);
+	return NULL;
+}
+
+static void print_percentiles(const char *name, uint64_t *values, size_t num)
+{
+	if (!num) {
+		printf("%s: no samples\n", name);
+		return;
+	}
+
+	qsort(values, num, sizeof(uint64_t), cmp_uint64);
+	printf("%s [us]: p50=%.1f p90=%.1f p99=%.1f max=%.1f\n", name, values[num / 2] * 1e-3,
+	       values[num * 9 / 10] * 1e-3, values[num * 99 / 100] * 1e-3, values[num - 1] * 1e-3);
+}
+
+static void fill_frame(struct obs_source_frame *frame, int index)
+{
+	// Touch every line so that the source is not kept in the cache.
+	for (int i = 0; i < MAX_AV_PLANES && frame->data[i]; i++) {
+		uint32_t height = frame_plane_height(frame->format, i, frame->height);
+		for (uint32_t y = 0; y < height; y++)
+			frame->data[i][(size_t)frame->linesize[i] * y] = (uint8_t)(index + y);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_args args;
+	if (!parse_args(&args, argc, argv)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	frame_copy_init();
+
+	obs_data_t *settings = obs_data_create();
+	async_record_get_defaults(settings);
+	obs_data_set_bool(settings, "direct_output", args.direct_output);
+	obs_data_set_int(settings, "copy_threads", args.copy_threads);
+	obs_data_set_int(settings, "queue_max_frames", args.queue_max_frames);
+	struct async_record *s = async_record_alloc(settings, NULL);
+	obs_data_release(settings);
+	s->need_restart = false;
+
+	struct obs_source_frame *src = obs_source_frame_create(args.format, args.width, args.height);
+	size_t frame_size = frame_data_size(src);
+
+	struct video_output_info vi = {0};
+	vi.name = "bench";
+	vi.format = args.format;
+	vi.width = args.width;
+	vi.height = args.height;
+	vi.fps_num = args.fps ? args.fps : 60;
+	vi.fps_den = 1;
+	vi.cache_size = get_cache_size(s, frame_size);
+	vi.colorspace = VIDEO_CS_DEFAULT;
+	vi.range = VIDEO_RANGE_PARTIAL;
+	if (video_output_open(&s->video_output, &vi) != VIDEO_OUTPUT_SUCCESS) {
+		fprintf(stderr, "video_output_open failed\n");
+		return 1;
+	}
+	s->video_frame_interval = video_output_get_frame_time(s->video_output);
+
+	struct bench_output out = {0};
+	pthread_mutex_init(&out.mutex, NULL);
+	video_output_connect(s->video_output, NULL, raw_video_cb, &out);
+
+	s->record = true;
+	pthread_create(&s->thread, NULL, bench_record_thread, s);
+
+	DARRAY(uint64_t) call_times;
+	da_init(call_times);
+
+	long allocs_start = os_atomic_load_long(&s->frame_pool.allocated);
+	uint64_t interval = args.fps ? 1000000000ULL / args.fps : 0;
+	uint64_t start_ns = os_gettime_ns();
+	uint64_t ts = start_ns;
+
+	for (int i = 0; i < args.frames; i++) {
+		fill_frame(src, i);
+
+		// Without a rate, make up timestamps on the output grid so that no frame is discarded.
+		// The same time is given as the reception time so that the clock of the source does not look drifting.
+		src->timestamp = args.fps ? os_gettime_ns() : ts;
+		ts += s->video_frame_interval;
+
+		uint64_t t0 = os_gettime_ns();
+		record_video(s, src, args.fps ? t0 : src->timestamp);
+		uint64_t t1 = os_gettime_ns();
+		da_push_back(call_times, &(uint64_t){t1 - t0});
+
+		if (interval)
+			os_sleepto_ns(start_ns + interval * (i + 1));
+	}
+
+	while (frame_ring_count(&s->video_frames))
+		os_sleep_ms(1);
+	uint64_t end_ns = os_gettime_ns();
+	long allocs_end = os_atomic_load_long(&s->frame_pool.allocated);
+
+	// Let the video output thread deliver the last frames.
+	os_sleep_ms(100);
+
+	struct record_stats stats = s->stats;
+	video_t *video_output = s->video_output;
+	async_record_destroy(s);
+	video_output_disconnect(video_output, raw_video_cb, &out);
+	video_output_close(video_output);
+
+	double elapsed = (end_ns - start_ns) * 1e-9;
+	printf("frames: %d, %ux%u, %zu bytes/frame\n", args.frames, args.width, args.height, frame_size);
+	printf("elapsed: %.3f s, throughput: %.1f fps, %.1f MB/s\n", elapsed, args.frames / elapsed,
+	       args.frames * (double)frame_size / elapsed / 1e6);
+	printf("received=%ld queued=%ld sent=%ld dropped=%ld duplicated=%ld queue_max=%ld drift_us=%ld output=%ld\n",
+	       stats.received, stats.queued, stats.sent, stats.dropped, stats.duplicated, stats.queue_max,
+	       stats.drift_us, os_atomic_load_long(&out.received));
+	print_percentiles("async_record_video", call_times.array, call_times.num);
+	if (args.fps)
+		print_percentiles("latency to video_output", out.latencies.array, out.latencies.num);
+	printf("frame allocations during the run: %ld, %.3f per frame\n", allocs_end - allocs_start,
+	       (double)(allocs_end - allocs_start) / args.frames);
+#ifndef _WIN32
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("peak RSS: %ld KiB\n", usage.ru_maxrss);
+#endif
+
+	da_free(call_times);
+	da_free(out.latencies);
+	pthread_mutex_destroy(&out.mutex);
+	obs_source_frame_destroy(src);
+	return 0;
+}
@@ -0,0 +1,221 @@
+#include <obs-module.h>
+#include <util/platform.h>
+#include <util/util_uint64.h>
+#include "audio-ring.h"
+
+#define SLOT(ring, index) (&(ring)->slots[(unsigned long)(index) & ((ring)->capacity - 1)])
+
+// Smallest packet size assumed to derive the number of slots from a duration.
+#define AUDIO_RING_PACKET_FRAMES 480
+
+static size_t capacity_for(uint32_t sample_rate, uint64_t duration_ns)
+{
+	uint64_t packets = util_mul_div64(duration_ns, sample_rate, 1000000000ULL * AUDIO_RING_PACKET_FRAMES);
+	size_t capacity = AUDIO_RING_MIN_SLOTS;
+	while (capacity < packets)
+		capacity *= 2;
+	return capacity;
+}
+
+static void allocate_slots(struct audio_ring *ring, size_t capacity)
+{
+	ring->capacity = capacity;
+	ring->slots = bzalloc(sizeof(struct audio_ring_slot) * capacity);
+
+	size_t slot_size = AUDIO_RING_SLOT_FRAMES * ring->channels;
+	ring->buffer = bmalloc(sizeof(float) * slot_size * capacity);
+	for (size_t i = 0; i < capacity; i++) {
+		for (size_t ch = 0; ch < ring->channels; ch++)
+			ring->slots[i].data[ch] = ring->buffer + slot_size * i + AUDIO_RING_SLOT_FRAMES * ch;
+	}
+}
+
+void audio_ring_init(struct audio_ring *ring, size_t channels, uint32_t sample_rate, uint64_t duration_ns)
+{
+	memset(ring, 0, sizeof(*ring));
+	if (channels > MAX_AUDIO_CHANNELS)
+		channels = MAX_AUDIO_CHANNELS;
+	ring->channels = channels;
+	ring->sample_rate = sample_rate;
+
+	allocate_slots(ring, capacity_for(sample_rate, duration_ns));
+}
+
+void audio_ring_free(struct audio_ring *ring)
+{
+	bfree(ring->buffer);
+	bfree(ring->slots);
+	ring->buffer = NULL;
+	ring->slots = NULL;
+}
+
+void audio_ring_set_duration(struct audio_ring *ring, uint64_t duration_ns)
+{
+	size_t capacity = capacity_for(ring->sample_rate, duration_ns);
+	if (capacity == ring->capacity)
+		return;
+
+	os_atomic_set_bool(&ring->resizing, true);
+	while (os_atomic_load_long(&ring->users))
+		os_sleep_ms(1);
+
+	audio_ring_free(ring);
+	allocate_slots(ring, capacity);
+	os_atomic_set_long(&ring->head, 0);
+	os_atomic_set_long(&ring->tail, 0);
+
+	os_atomic_set_bool(&ring->resizing, false);
+}
+
+static bool enter(struct audio_ring *ring)
+{
+	if (os_atomic_load_bool(&ring->resizing))
+		return false;
+	os_atomic_inc_long(&ring->users);
+	if (os_atomic_load_bool(&ring->resizing)) {
+		os_atomic_dec_long(&ring->users);
+		return false;
+	}
+	return true;
+}
+
+static void leave(struct audio_ring *ring)
+{
+	os_atomic_dec_long(&ring->users);
+}
+
+static inline uint64_t frames_to_ns(const struct audio_ring *ring, uint64_t frames)
+{
+	return util_mul_div64(frames, 1000000000ULL, ring->sample_rate);
+}
+
+static inline uint64_t ns_to_frames(const struct audio_ring *ring, uint64_t ns)
+{
+	return util_mul_div64(ns, ring->sample_rate, 1000000000ULL);
+}
+
+static void add_dropped(struct audio_ring *ring, uint32_t frames)
+{
+	long prev = os_atomic_load_long(&ring->dropped_frames);
+	while (!os_atomic_compare_swap_long(&ring->dropped_frames, prev, prev + (long)frames))
+		prev = os_atomic_load_long(&ring->dropped_frames);
+}
+
+bool audio_ring_push(struct audio_ring *ring, const float *const data[MAX_AUDIO_CHANNELS], uint32_t frames,
+		     uint64_t timestamp, bool drop_oldest)
+{
+	if (!enter(ring)) {
+		add_dropped(ring, frames);
+		return false;
+	}
+
+	long head = os_atomic_load_long(&ring->head);
+	uint32_t pushed = 0;
+	bool dropped = false;
+
+	while (pushed < frames) {
+		long tail = os_atomic_load_long(&ring->tail);
+		if ((unsigned long)head - (unsigned long)tail >= ring->capacity) {
+			if (!drop_oldest)
+				break;
+			struct audio_ring_slot *oldest = SLOT(ring, tail);
+			uint32_t remaining = oldest->frames - oldest->offset;
+			if (os_atomic_compare_swap_long(&ring->tail, tail, (long)((unsigned long)tail + 1))) {
+				add_dropped(ring, remaining);
+				dropped = true;
+			}
+			continue;
+		}
+
+		// The dropped slot is the one written next. A pull that loaded the tail before the drop might still be
+		// reading it and updating its offset, so wait for that pull to finish. It copies one packet at most.
+		if (dropped) {
+			while (os_atomic_load_bool(&ring->reading))
+				;
+			dropped = false;
+		}
+
+		struct audio_ring_slot *slot = SLOT(ring, head);
+		uint32_t n = frames - pushed;
+		if (n > AUDIO_RING_SLOT_FRAMES)
+			n = AUDIO_RING_SLOT_FRAMES;
+
+		slot->timestamp = timestamp + frames_to_ns(ring, pushed);
+		slot->frames = n;
+		slot->offset = 0;
+		for (size_t ch = 0; ch < ring->channels; ch++) {
+			if (data[ch])
+				memcpy(slot->data[ch], data[ch] + pushed, sizeof(float) * n);
+			else
+				memset(slot->data[ch], 0, sizeof(float) * n);
+		}
+
+		head = (long)((unsigned long)head + 1);
+		os_atomic_set_long(&ring->head, head);
+		pushed += n;
+	}
+
+	leave(ring);
+
+	if (pushed < frames) {
+		add_dropped(ring, frames - pushed);
+		return false;
+	}
+	return true;
+}
+
+void audio_ring_pull(struct audio_ring *ring, float *const out[MAX_AUDIO_CHANNELS], uint32_t frames,
+		     uint64_t timestamp)
+{
+	if (!enter(ring))
+		return;
+
+	// Set before loading the tail so that the producer sees it if it drops the slot being read.
+	os_atomic_set_bool(&ring->reading, true);
+
+	const uint64_t end_ts = timestamp + frames_to_ns(ring, frames);
+	long tail = os_atomic_load_long(&ring->tail);
+	long head = os_atomic_load_long(&ring->head);
+
+	while (tail != head) {
+		struct audio_ring_slot *slot = SLOT(ring, tail);
+		uint64_t slot_ts = slot->timestamp + frames_to_ns(ring, slot->offset);
+		uint32_t slot_frames = slot->frames - slot->offset;
+
+		if (slot_ts >= end_ts)
+			break;
+
+		uint32_t skip = 0;
+		uint32_t dst = 0;
+		if (slot_ts < timestamp) {
+			uint64_t late = ns_to_frames(ring, timestamp - slot_ts);
+			skip = late < slot_frames ? (uint32_t)late : slot_frames;
+		}
+		else {
+			uint64_t early = ns_to_frames(ring, slot_ts - timestamp);
+			dst = early < frames ? (uint32_t)early : frames;
+		}
+
+		uint32_t n = slot_frames - skip;
+		if (n > frames - dst)
+			n = frames - dst;
+
+		for (size_t ch = 0; ch < ring->channels; ch++) {
+			if (out[ch])
+				memcpy(out[ch] + dst, slot->data[ch] + slot->offset + skip, sizeof(float) * n);
+		}
+
+		slot->offset += skip + n;
+		if (slot->offset < slot->frames)
+			break;
+
+		// The producer might have dropped the slot in the meantime.
+		if (!os_atomic_compare_swap_long(&ring->tail, tail, (long)((unsigned long)tail + 1)))
+			tail = os_atomic_load_long(&ring->tail);
+		else
+			tail = (long)((unsigned long)tail + 1);
+	}
+
+	os_atomic_set_bool(&ring->reading, false);
+	leave(ring);
+}
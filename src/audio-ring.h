@@ -0,0 +1,59 @@
+#pragma once
+
+#include <obs.h>
+#include <util/threading.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AUDIO_RING_MIN_SLOTS 128
+#define AUDIO_RING_SLOT_FRAMES 1024
+
+struct audio_ring_slot
+{
+	uint64_t timestamp;
+	uint32_t frames;
+	uint32_t offset; // frames already consumed
+	float *data[MAX_AUDIO_CHANNELS];
+};
+
+// Preallocated lock-free ring of audio packets.
+// `audio_ring_push` is called only from the audio callback and `audio_ring_pull` only from the audio output thread.
+struct audio_ring
+{
+	struct audio_ring_slot *slots;
+	size_t capacity; // power of 2
+	float *buffer;
+	size_t channels;
+	uint32_t sample_rate;
+	volatile long head; // updated only by the producer
+	volatile long tail; // updated by the consumer, or by the producer when it drops the oldest packet
+	volatile long dropped_frames;
+	volatile bool reading; // set by the consumer while it reads slots
+
+	// While `resizing` is set, push and pull return without touching the ring.
+	volatile bool resizing;
+	volatile long users;
+};
+
+// The ring holds at least `duration_ns` of audio, assuming packets of 480 frames or more.
+void audio_ring_init(struct audio_ring *ring, size_t channels, uint32_t sample_rate, uint64_t duration_ns);
+void audio_ring_free(struct audio_ring *ring);
+
+// Reallocates the ring if the capacity changes. The queued audio is discarded. Any thread may call this.
+void audio_ring_set_duration(struct audio_ring *ring, uint64_t duration_ns);
+
+// Returns false if the packet did not fit and some frames were dropped.
+// If `drop_oldest` is set, the oldest packets are dropped instead of the new ones. A dropped slot is reused only after
+// the pull in progress, if any, has finished reading it.
+bool audio_ring_push(struct audio_ring *ring, const float *const data[MAX_AUDIO_CHANNELS], uint32_t frames,
+		     uint64_t timestamp, bool drop_oldest);
+
+// Fills `out` with the frames in [timestamp, timestamp + frames). Missing frames are not written.
+void audio_ring_pull(struct audio_ring *ring, float *const out[MAX_AUDIO_CHANNELS], uint32_t frames,
+		     uint64_t timestamp);
+
+#ifdef __cplusplus
+}
+#endif
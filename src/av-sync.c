@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <obs-module.h>
+#include "plugin-macros.generated.h"
+#include "av-sync.h"
+
+// Weight of a new observation is 1 / AV_SYNC_SMOOTHING.
+#define AV_SYNC_SMOOTHING 64
+
+// A larger difference is taken as a discontinuity of the source clock, not as drift.
+#define AV_SYNC_RESET_NS 1000000000LL
+
+// The audio is shifted once the drift from the contiguous position exceeds this.
+#define AV_SYNC_AUDIO_TOLERANCE_NS 20000000LL
+
+void av_sync_init(struct av_sync *sync)
+{
+	memset(sync, 0, sizeof(*sync));
+	pthread_mutex_init(&sync->mutex, NULL);
+}
+
+void av_sync_free(struct av_sync *sync)
+{
+	pthread_mutex_destroy(&sync->mutex);
+}
+
+void av_sync_reset(struct av_sync *sync)
+{
+	pthread_mutex_lock(&sync->mutex);
+	sync->valid = false;
+	sync->offset = 0;
+	sync->base_offset = 0;
+	sync->audio_next = 0;
+	pthread_mutex_unlock(&sync->mutex);
+}
+
+void av_sync_observe(struct av_sync *sync, uint64_t source_ts, uint64_t system_ts)
+{
+	int64_t sample = (int64_t)(system_ts - source_ts);
+
+	pthread_mutex_lock(&sync->mutex);
+	if (!sync->valid) {
+		sync->valid = true;
+		sync->offset = sample;
+		sync->base_offset = sample;
+	}
+	else if (llabs(sample - sync->offset) > AV_SYNC_RESET_NS) {
+		blog(LOG_INFO, "%p: source clock jumped by %.3f s", sync, (sample - sync->offset) * 1e-9);
+		sync->base_offset += sample - sync->offset;
+		sync->offset = sample;
+	}
+	else {
+		sync->offset += (sample - sync->offset) / AV_SYNC_SMOOTHING;
+	}
+	pthread_mutex_unlock(&sync->mutex);
+}
+
+uint64_t av_sync_to_system(struct av_sync *sync, uint64_t source_ts)
+{
+	pthread_mutex_lock(&sync->mutex);
+	uint64_t ts = source_ts + (uint64_t)sync->offset;
+	pthread_mutex_unlock(&sync->mutex);
+	return ts;
+}
+
+int64_t av_sync_drift(struct av_sync *sync)
+{
+	pthread_mutex_lock(&sync->mutex);
+	int64_t drift = sync->offset - sync->base_offset;
+	pthread_mutex_unlock(&sync->mutex);
+	return drift;
+}
+
+uint64_t av_sync_audio_window(struct av_sync *sync, uint64_t system_ts, uint64_t duration)
+{
+	pthread_mutex_lock(&sync->mutex);
+
+	uint64_t ts = system_ts - (uint64_t)sync->offset;
+	if (sync->audio_next) {
+		int64_t diff = (int64_t)(ts - sync->audio_next);
+		if (llabs(diff) <= AV_SYNC_AUDIO_TOLERANCE_NS) {
+			ts = sync->audio_next;
+		}
+		else {
+			blog(LOG_DEBUG, "%p: shifting audio by %.3f ms", sync, diff * 1e-6);
+		}
+	}
+	sync->audio_next = ts + duration;
+
+	pthread_mutex_unlock(&sync->mutex);
+	return ts;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <obs.h>
+#include <util/threading.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Maps timestamps of the parent source onto the system clock that `video_output` and `audio_output` run on.
+// The offset between the clocks is smoothed over the received frames so that a source whose clock runs slightly
+// faster or slower than the system clock stays in sync over long recordings. The accumulated difference is the drift.
+struct av_sync
+{
+	pthread_mutex_t mutex;
+	bool valid;
+	int64_t offset;      // smoothed difference, system clock minus source clock
+	int64_t base_offset; // offset at the start, shifted when the source clock jumps
+	uint64_t audio_next; // source timestamp following the last audio window, used only by the audio thread
+};
+
+void av_sync_init(struct av_sync *sync);
+void av_sync_free(struct av_sync *sync);
+void av_sync_reset(struct av_sync *sync);
+
+// Called when a frame with `source_ts` is received at `system_ts`.
+void av_sync_observe(struct av_sync *sync, uint64_t source_ts, uint64_t system_ts);
+
+uint64_t av_sync_to_system(struct av_sync *sync, uint64_t source_ts);
+int64_t av_sync_drift(struct av_sync *sync);
+
+// Returns the source timestamp of the audio window that will be output at `system_ts`.
+// Windows are kept contiguous until the drift exceeds a tolerance, then the window is shifted at once so that
+// some audio is dropped or padded with silence.
+uint64_t av_sync_audio_window(struct av_sync *sync, uint64_t system_ts, uint64_t duration);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,352 @@
+#include <obs-module.h>
+#include <util/dstr.h>
+#include <util/platform.h>
+#include "plugin-macros.generated.h"
+#include "encoder-config.h"
+
+void encoder_config_free(struct encoder_config *cfg)
+{
+	bfree(cfg->video_encoder);
+	bfree(cfg->obs_encoder);
+	bfree(cfg->preset);
+	bfree(cfg->tune);
+	cfg->video_encoder = NULL;
+	cfg->obs_encoder = NULL;
+	cfg->preset = NULL;
+	cfg->tune = NULL;
+}
+
+static bool update_string(char **dst, obs_data_t *settings, const char *name)
+{
+	const char *value = obs_data_get_string(settings, name);
+	if (!*dst || strcmp(value, *dst)) {
+		bfree(*dst);
+		*dst = bstrdup(value);
+		return true;
+	}
+	return false;
+}
+
+static bool update_int(int *dst, obs_data_t *settings, const char *name)
+{
+	int value = (int)obs_data_get_int(settings, name);
+	if (value == *dst)
+		return false;
+	*dst = value;
+	return true;
+}
+
+bool encoder_config_update(struct encoder_config *cfg, obs_data_t *settings)
+{
+	bool changed = false;
+	bool native = obs_data_get_bool(settings, "obs_encoders");
+	changed |= native != cfg->native;
+	cfg->native = native;
+	bool share = obs_data_get_bool(settings, "share_encoder");
+	changed |= share != cfg->share;
+	cfg->share = share;
+	changed |= update_string(&cfg->video_encoder, settings, "video_encoder");
+	changed |= update_string(&cfg->obs_encoder, settings, "obs_video_encoder");
+	changed |= update_string(&cfg->preset, settings, "encoder_preset");
+	changed |= update_string(&cfg->tune, settings, "encoder_tune");
+
+	encoder_lossless lossless = (encoder_lossless)obs_data_get_int(settings, "lossless");
+	changed |= lossless != cfg->lossless;
+	cfg->lossless = lossless;
+
+	encoder_rate_control rc = (encoder_rate_control)obs_data_get_int(settings, "rate_control");
+	changed |= rc != cfg->rate_control;
+	cfg->rate_control = rc;
+
+	changed |= update_int(&cfg->bitrate, settings, "video_bitrate");
+	changed |= update_int(&cfg->quality, settings, "video_quality");
+	changed |= update_int(&cfg->keyint_sec, settings, "keyint_sec");
+	changed |= update_int(&cfg->threads, settings, "encoder_threads");
+	changed |= update_int(&cfg->audio_bitrate, settings, "audio_bitrate");
+	return changed;
+}
+
+void encoder_config_get_defaults(obs_data_t *settings)
+{
+	obs_data_set_default_bool(settings, "obs_encoders", false);
+	obs_data_set_default_bool(settings, "share_encoder", false);
+	obs_data_set_default_string(settings, "video_encoder", "");
+	obs_data_set_default_string(settings, "obs_video_encoder", "obs_x264");
+	obs_data_set_default_int(settings, "lossless", lossless_off);
+	obs_data_set_default_int(settings, "rate_control", rate_control_cbr);
+	obs_data_set_default_int(settings, "video_bitrate", 2500);
+	obs_data_set_default_int(settings, "video_quality", 23);
+	obs_data_set_default_string(settings, "encoder_preset", "");
+	obs_data_set_default_string(settings, "encoder_tune", "");
+	obs_data_set_default_int(settings, "keyint_sec", 0);
+	obs_data_set_default_int(settings, "encoder_threads", 0);
+	obs_data_set_default_int(settings, "audio_bitrate", 320);
+}
+
+static bool obs_encoders_modified(obs_properties_t *props, obs_property_t *property, obs_data_t *settings)
+{
+	UNUSED_PARAMETER(property);
+	bool native = obs_data_get_bool(settings, "obs_encoders");
+	obs_property_set_visible(obs_properties_get(props, "video_encoder"), !native);
+	obs_property_set_visible(obs_properties_get(props, "share_encoder"), native);
+	return true;
+}
+
+static void add_obs_encoder_list(obs_properties_t *props)
+{
+	obs_property_t *prop = obs_properties_add_list(props, "obs_video_encoder", obs_module_text("OBS video encoder"),
+						       OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
+	obs_property_set_long_description(
+		prop, obs_module_text("Used by the replay buffer and when encoding with OBS encoders. The encoder has "
+				      "to support the rate control above."));
+
+	const char *id;
+	for (size_t i = 0; obs_enum_encoder_types(i, &id); i++) {
+		if (obs_get_encoder_type(id) != OBS_ENCODER_VIDEO)
+			continue;
+		if (obs_get_encoder_caps(id) & (OBS_ENCODER_CAP_DEPRECATED | OBS_ENCODER_CAP_INTERNAL))
+			continue;
+		obs_property_list_add_string(prop, obs_encoder_get_display_name(id), id);
+	}
+}
+
+static bool rate_control_modified(obs_properties_t *props, obs_property_t *property, obs_data_t *settings)
+{
+	UNUSED_PARAMETER(property);
+	encoder_rate_control rc = (encoder_rate_control)obs_data_get_int(settings, "rate_control");
+	obs_property_set_visible(obs_properties_get(props, "video_bitrate"), rc == rate_control_cbr);
+	obs_property_set_visible(obs_properties_get(props, "video_quality"), rc != rate_control_cbr);
+	return true;
+}
+
+void encoder_config_add_properties(obs_properties_t *props)
+{
+	obs_properties_t *pp = obs_properties_create();
+	obs_property_t *prop;
+
+	prop = obs_properties_add_bool(pp, "obs_encoders", obs_module_text("Encode with OBS encoders"));
+	obs_property_set_long_description(
+		prop, obs_module_text("Encode on the encoder threads of OBS and write the file with ffmpeg-mux instead "
+				      "of encoding inside the FFmpeg output. The encoders are kept across split files, "
+				      "which then start at a keyframe."));
+	obs_property_set_modified_callback(prop, obs_encoders_modified);
+
+	prop = obs_properties_add_bool(pp, "share_encoder", obs_module_text("Share encoders with other filters"));
+	obs_property_set_long_description(
+		prop, obs_module_text("Filters on the same source with the same encoder settings write their files "
+				      "from the encoders of the filter that started first. When that filter stops, the "
+				      "others start new files with their own encoders."));
+
+	prop = obs_properties_add_list(pp, "video_encoder", obs_module_text("Video encoder"), OBS_COMBO_TYPE_EDITABLE,
+				       OBS_COMBO_FORMAT_STRING);
+	obs_property_list_add_string(prop, obs_module_text("Default of the container"), "");
+	obs_property_list_add_string(prop, "libx264", "libx264");
+	obs_property_list_add_string(prop, "libx264rgb", "libx264rgb");
+	obs_property_list_add_string(prop, "libx265", "libx265");
+	obs_property_list_add_string(prop, "h264_nvenc", "h264_nvenc");
+	obs_property_list_add_string(prop, "hevc_nvenc", "hevc_nvenc");
+	obs_property_list_add_string(prop, "libsvtav1", "libsvtav1");
+	obs_property_set_long_description(prop,
+					  obs_module_text("Name of the FFmpeg encoder used by the FFmpeg output."));
+	add_obs_encoder_list(pp);
+
+	prop = obs_properties_add_list(pp, "lossless", obs_module_text("Lossless intra-only"), OBS_COMBO_TYPE_LIST,
+				       OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, obs_module_text("Off"), lossless_off);
+	obs_property_list_add_int(prop, "FFV1", lossless_ffv1);
+	obs_property_list_add_int(prop, "UT Video", lossless_utvideo);
+	obs_property_list_add_int(prop, obs_module_text("Uncompressed"), lossless_raw);
+	obs_property_set_long_description(
+		prop, obs_module_text("Encode every frame on its own without loss, split into slices encoded on the "
+				      "threads below. The rate control, preset and tune are ignored and the FFmpeg "
+				      "output is used. Use mkv or nut as the extension."));
+
+	prop = obs_properties_add_list(pp, "rate_control", obs_module_text("Rate control"), OBS_COMBO_TYPE_LIST,
+				       OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, "CBR", rate_control_cbr);
+	obs_property_list_add_int(prop, "CRF", rate_control_crf);
+	obs_property_list_add_int(prop, "CQP", rate_control_cqp);
+	obs_property_set_modified_callback(prop, rate_control_modified);
+
+	prop = obs_properties_add_int(pp, "video_bitrate", obs_module_text("Video bitrate"), 100, 1000000, 100);
+	obs_property_int_set_suffix(prop, " kbps");
+	obs_properties_add_int(pp, "video_quality", obs_module_text("Quality (CRF or QP)"), 0, 63, 1);
+
+	prop = obs_properties_add_text(pp, "encoder_preset", obs_module_text("Preset"), OBS_TEXT_DEFAULT);
+	obs_property_set_long_description(
+		prop, obs_module_text("Preset name of the encoder such as veryfast. Leave empty for the default."));
+	prop = obs_properties_add_text(pp, "encoder_tune", obs_module_text("Tune"), OBS_TEXT_DEFAULT);
+	obs_property_set_long_description(prop, obs_module_text("Leave empty not to tune."));
+
+	prop = obs_properties_add_int(pp, "keyint_sec", obs_module_text("Keyframe interval"), 0, 20, 1);
+	obs_property_int_set_suffix(prop, " s");
+	obs_property_set_long_description(prop, obs_module_text("Set 0 for the default of the encoder."));
+	prop = obs_properties_add_int(pp, "encoder_threads", obs_module_text("Encoder threads"), 0, 64, 1);
+	obs_property_set_long_description(prop, obs_module_text("Set 0 for the default of the encoder."));
+
+	prop = obs_properties_add_int(pp, "audio_bitrate", obs_module_text("Audio bitrate"), 32, 1024, 32);
+	obs_property_int_set_suffix(prop, " kbps");
+
+	obs_properties_add_group(props, "encoder", obs_module_text("Encoder"), OBS_GROUP_NORMAL, pp);
+}
+
+void encoder_config_signature(const struct encoder_config *cfg, struct dstr *str)
+{
+	dstr_catf(str, "%s rc=%d bitrate=%d quality=%d preset=%s tune=%s keyint=%d threads=%d audio=%d",
+		  cfg->obs_encoder ? cfg->obs_encoder : "", (int)cfg->rate_control, cfg->bitrate, cfg->quality,
+		  cfg->preset ? cfg->preset : "", cfg->tune ? cfg->tune : "", cfg->keyint_sec, cfg->threads,
+		  cfg->audio_bitrate);
+}
+
+static void add_option(struct dstr *str, const char *name, const char *value)
+{
+	if (!value || !*value)
+		return;
+	if (str->len)
+		dstr_cat_ch(str, ' ');
+	dstr_catf(str, "%s=%s", name, value);
+}
+
+static void add_option_int(struct dstr *str, const char *name, int value)
+{
+	char buf[16];
+	snprintf(buf, sizeof(buf), "%d", value);
+	add_option(str, name, buf);
+}
+
+// FFV1 accepts only slice counts that tile the frame, see `ffv1enc.c`.
+static const int ffv1_slices[] = {4, 6, 9, 12, 16, 20, 24, 30};
+
+static int get_ffv1_slices(int threads)
+{
+	size_t n = sizeof(ffv1_slices) / sizeof(*ffv1_slices);
+	for (size_t i = 0; i < n; i++) {
+		if (ffv1_slices[i] >= threads)
+			return ffv1_slices[i];
+	}
+	return ffv1_slices[n - 1];
+}
+
+// Every frame is a keyframe and the slices are encoded in parallel so that the time per frame stays predictable.
+static void apply_lossless(const struct encoder_config *cfg, obs_data_t *data)
+{
+	int threads = cfg->threads > 0 ? cfg->threads : os_get_logical_cores();
+	struct dstr opts = {0};
+
+	switch (cfg->lossless) {
+	case lossless_off:
+		return;
+	case lossless_ffv1:
+		obs_data_set_string(data, "video_encoder", "ffv1");
+		add_option(&opts, "level", "3");
+		add_option_int(&opts, "slices", get_ffv1_slices(threads));
+		add_option(&opts, "slicecrc", "1");
+		add_option_int(&opts, "threads", threads);
+		break;
+	case lossless_utvideo:
+		obs_data_set_string(data, "video_encoder", "utvideo");
+		add_option_int(&opts, "slices", threads);
+		add_option_int(&opts, "threads", threads);
+		break;
+	case lossless_raw:
+		obs_data_set_string(data, "video_encoder", "rawvideo");
+		break;
+	}
+
+	obs_data_set_int(data, "video_bitrate", 0);
+	obs_data_set_int(data, "gop_size", 1);
+	if (opts.len)
+		obs_data_set_string(data, "video_settings", opts.array);
+	dstr_free(&opts);
+}
+
+void encoder_config_apply_ffmpeg(const struct encoder_config *cfg, obs_data_t *data,
+				 const struct video_output_info *voi)
+{
+	obs_data_set_int(data, "audio_bitrate", cfg->audio_bitrate);
+
+	if (cfg->lossless != lossless_off) {
+		apply_lossless(cfg, data);
+		return;
+	}
+
+	if (cfg->video_encoder && *cfg->video_encoder)
+		obs_data_set_string(data, "video_encoder", cfg->video_encoder);
+
+	// FFmpeg encoders take the quality target from their private options, which `ffmpeg_output` passes through
+	// `video_settings`. Without a bitrate, the encoder falls back to its own quality based mode.
+	struct dstr opts = {0};
+	switch (cfg->rate_control) {
+	case rate_control_cbr:
+		obs_data_set_int(data, "video_bitrate", cfg->bitrate);
+		break;
+	case rate_control_crf:
+		obs_data_set_int(data, "video_bitrate", 0);
+		add_option_int(&opts, "crf", cfg->quality);
+		break;
+	case rate_control_cqp:
+		obs_data_set_int(data, "video_bitrate", 0);
+		add_option_int(&opts, "qp", cfg->quality);
+		break;
+	}
+	add_option(&opts, "preset", cfg->preset);
+	add_option(&opts, "tune", cfg->tune);
+	if (cfg->threads > 0)
+		add_option_int(&opts, "threads", cfg->threads);
+	if (opts.len)
+		obs_data_set_string(data, "video_settings", opts.array);
+	dstr_free(&opts);
+
+	if (cfg->keyint_sec > 0 && voi && voi->fps_den)
+		obs_data_set_int(data, "gop_size", (long long)cfg->keyint_sec * voi->fps_num / voi->fps_den);
+}
+
+// The keys below are the ones shared by most libobs encoders. Options only x264 understands go to `x264opts`.
+obs_data_t *encoder_config_obs_settings(const struct encoder_config *cfg)
+{
+	obs_data_t *data = obs_data_create();
+	bool x264 = cfg->obs_encoder && strcmp(cfg->obs_encoder, "obs_x264") == 0;
+	struct dstr opts = {0};
+
+	switch (cfg->rate_control) {
+	case rate_control_cbr:
+		obs_data_set_string(data, "rate_control", "CBR");
+		obs_data_set_int(data, "bitrate", cfg->bitrate);
+		break;
+	case rate_control_crf:
+		obs_data_set_string(data, "rate_control", "CRF");
+		obs_data_set_int(data, "crf", cfg->quality);
+		break;
+	case rate_control_cqp:
+		if (x264) {
+			// `obs_x264` has no CQP mode but x264 switches to it when `qp` is given.
+			obs_data_set_string(data, "rate_control", "CRF");
+			add_option_int(&opts, "qp", cfg->quality);
+		}
+		else {
+			obs_data_set_string(data, "rate_control", "CQP");
+			obs_data_set_int(data, "cqp", cfg->quality);
+		}
+		break;
+	}
+	if (cfg->preset && *cfg->preset)
+		obs_data_set_string(data, "preset", cfg->preset);
+	if (cfg->tune && *cfg->tune)
+		obs_data_set_string(data, "tune", cfg->tune);
+	if (cfg->keyint_sec > 0)
+		obs_data_set_int(data, "keyint_sec", cfg->keyint_sec);
+	if (x264 && cfg->threads > 0)
+		add_option_int(&opts, "threads", cfg->threads);
+	if (opts.len)
+		obs_data_set_string(data, "x264opts", opts.array);
+	dstr_free(&opts);
+
+	return data;
+}
+
+obs_data_t *encoder_config_aac_settings(const struct encoder_config *cfg)
+{
+	obs_data_t *data = obs_data_create();
+	obs_data_set_int(data, "bitrate", cfg->audio_bitrate);
+	return data;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <obs.h>
+#include <util/dstr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum encoder_rate_control {
+	rate_control_cbr = 0,
+	rate_control_crf,
+	rate_control_cqp,
+} encoder_rate_control;
+
+typedef enum encoder_lossless {
+	lossless_off = 0,
+	lossless_ffv1,
+	lossless_utvideo,
+	lossless_raw,
+} encoder_lossless;
+
+// Encoder settings shared by the outputs. The strings are owned by the config.
+struct encoder_config
+{
+	bool native;         // encode with libobs encoders instead of inside `ffmpeg_output`
+	bool share;          // share the libobs encoders with other instances, see `encoder_share`
+	char *video_encoder; // FFmpeg codec name, empty for the default of the container
+	char *obs_encoder;   // id of the libobs video encoder, for the native pipeline and the replay buffer
+	// Intra-only lossless codec through `ffmpeg_output`, which overrides the settings below.
+	encoder_lossless lossless;
+	encoder_rate_control rate_control;
+	int bitrate; // kbps, used by CBR
+	int quality; // CRF or QP
+	char *preset;
+	char *tune;
+	int keyint_sec; // 0 for the encoder default
+	int threads;    // 0 for the encoder default
+	int audio_bitrate;
+};
+
+void encoder_config_free(struct encoder_config *cfg);
+
+// Returns true if any setting has changed.
+bool encoder_config_update(struct encoder_config *cfg, obs_data_t *settings);
+
+void encoder_config_get_defaults(obs_data_t *settings);
+void encoder_config_add_properties(obs_properties_t *props);
+
+// Appends the settings that affect the encoded packets, to tell whether encoders can be shared.
+void encoder_config_signature(const struct encoder_config *cfg, struct dstr *str);
+
+// Sets the encoder settings of `ffmpeg_output`. `voi` gives the frame rate to convert the keyframe interval.
+void encoder_config_apply_ffmpeg(const struct encoder_config *cfg, obs_data_t *data,
+				 const struct video_output_info *voi);
+
+// Returns new settings for the libobs encoder `obs_encoder` and the `ffmpeg_aac` encoder.
+obs_data_t *encoder_config_obs_settings(const struct encoder_config *cfg);
+obs_data_t *encoder_config_aac_settings(const struct encoder_config *cfg);
+
+#ifdef __cplusplus
+}
+#endif
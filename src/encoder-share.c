@@ -0,0 +1,131 @@
+#include <obs-module.h>
+#include <util/darray.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include "plugin-macros.generated.h"
+#include "encoder-share.h"
+
+struct encoder_share
+{
+	char *key;
+	obs_encoder_t *video_encoder;
+	obs_encoder_t *audio_encoder;
+	DARRAY(obs_output_t *) outputs; // outputs of the other instances that joined
+};
+
+// Held while an output joins or leaves so that a withdrawn share never has a started output left behind.
+static pthread_mutex_t shares_mutex;
+static DARRAY(struct encoder_share *) shares;
+
+void encoder_share_init(void)
+{
+	pthread_mutex_init(&shares_mutex, NULL);
+	da_init(shares);
+}
+
+void encoder_share_free(void)
+{
+	if (shares.num)
+		blog(LOG_WARNING, "encoder_share: %zu shares are left", shares.num);
+	da_free(shares);
+	pthread_mutex_destroy(&shares_mutex);
+}
+
+static struct encoder_share *find_share(const char *key)
+{
+	for (size_t i = 0; i < shares.num; i++) {
+		if (strcmp(shares.array[i]->key, key) == 0)
+			return shares.array[i];
+	}
+	return NULL;
+}
+
+struct encoder_share *encoder_share_publish(const char *key, obs_encoder_t *video_encoder,
+					    obs_encoder_t *audio_encoder)
+{
+	pthread_mutex_lock(&shares_mutex);
+	if (find_share(key)) {
+		pthread_mutex_unlock(&shares_mutex);
+		return NULL;
+	}
+
+	struct encoder_share *share = bzalloc(sizeof(struct encoder_share));
+	share->key = bstrdup(key);
+	share->video_encoder = video_encoder;
+	share->audio_encoder = audio_encoder;
+	da_push_back(shares, &share);
+	pthread_mutex_unlock(&shares_mutex);
+
+	blog(LOG_INFO, "encoder_share: published %s", key);
+	return share;
+}
+
+static bool any_active(const struct encoder_share *share)
+{
+	for (size_t i = 0; i < share->outputs.num; i++) {
+		if (obs_output_active(share->outputs.array[i]))
+			return true;
+	}
+	return false;
+}
+
+void encoder_share_withdraw(struct encoder_share *share, uint32_t timeout_ms)
+{
+	pthread_mutex_lock(&shares_mutex);
+	da_erase_item(shares, &share);
+
+	if (share->outputs.num)
+		blog(LOG_INFO, "encoder_share: stopping %zu outputs of %s", share->outputs.num, share->key);
+
+	for (size_t i = 0; i < share->outputs.num; i++)
+		obs_output_stop(share->outputs.array[i]);
+
+	uint64_t deadline = os_gettime_ns() + (uint64_t)timeout_ms * 1000000;
+	while (any_active(share) && os_gettime_ns() < deadline)
+		os_sleep_ms(10);
+
+	for (size_t i = 0; i < share->outputs.num; i++) {
+		obs_output_t *output = share->outputs.array[i];
+		if (obs_output_active(output)) {
+			blog(LOG_WARNING, "encoder_share: output %p did not stop in %u ms, forcing to stop", output,
+			     timeout_ms);
+			obs_output_force_stop(output);
+		}
+	}
+	pthread_mutex_unlock(&shares_mutex);
+
+	da_free(share->outputs);
+	bfree(share->key);
+	bfree(share);
+}
+
+bool encoder_share_join(const char *key, obs_output_t *output)
+{
+	pthread_mutex_lock(&shares_mutex);
+	struct encoder_share *share = find_share(key);
+	if (!share) {
+		pthread_mutex_unlock(&shares_mutex);
+		return false;
+	}
+
+	obs_output_set_video_encoder(output, share->video_encoder);
+	obs_output_set_audio_encoder(output, share->audio_encoder, 0);
+	if (!obs_output_start(output)) {
+		pthread_mutex_unlock(&shares_mutex);
+		blog(LOG_ERROR, "encoder_share: failed to start output %p with %s", output, key);
+		return false;
+	}
+	da_push_back(share->outputs, &output);
+	pthread_mutex_unlock(&shares_mutex);
+
+	blog(LOG_INFO, "encoder_share: output %p joined %s", output, key);
+	return true;
+}
+
+void encoder_share_leave(obs_output_t *output)
+{
+	pthread_mutex_lock(&shares_mutex);
+	for (size_t i = 0; i < shares.num; i++)
+		da_erase_item(shares.array[i]->outputs, &output);
+	pthread_mutex_unlock(&shares_mutex);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <obs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Encoders published by one filter instance so that other instances recording the same source with the same settings
+// write their files from the same packets instead of encoding the frames again.
+// The key identifies the source, the geometry and the encoder settings.
+struct encoder_share;
+
+void encoder_share_init(void);
+void encoder_share_free(void);
+
+// Returns NULL if encoders are already published with the same key.
+struct encoder_share *encoder_share_publish(const char *key, obs_encoder_t *video_encoder,
+					    obs_encoder_t *audio_encoder);
+
+// Stops the outputs that joined the share and waits until they become inactive, then frees the share.
+// Call this before the encoders or their media outputs are released.
+void encoder_share_withdraw(struct encoder_share *share, uint32_t timeout_ms);
+
+// Attaches the encoders published with `key` to `output` and starts it.
+// Returns false if nothing is published with the key or if the output failed to start.
+bool encoder_share_join(const char *key, obs_output_t *output);
+
+// Call this before `output` that has joined a share is released. Does nothing if the share has been withdrawn.
+void encoder_share_leave(obs_output_t *output);
+
+#ifdef __cplusplus
+}
+#endif
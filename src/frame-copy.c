@@ -0,0 +1,453 @@
+#include <obs-module.h>
+#include <util/darray.h>
+#include <util/threading.h>
+#include <util/platform.h>
+#include "frame-copy.h"
+#include "frame-util.h"
+#include "plugin-macros.generated.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define COPY_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+// STNP is only reachable through inline assembly, which MSVC does not have for ARM64.
+#define COPY_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET(x) __attribute__((target(x)))
+#else
+#define TARGET(x)
+#endif
+
+// Non-temporal stores only pay off if the destination does not fit in the cache.
+#define STREAM_THRESHOLD (256 * 1024)
+
+// Frames smaller than this are copied by the calling thread alone.
+#define MT_THRESHOLD (8 * 1024 * 1024)
+
+typedef void (*copy_fn)(uint8_t *dst, const uint8_t *src, size_t size);
+
+static void copy_memcpy(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	memcpy(dst, src, size);
+}
+
+#ifdef COPY_X86
+TARGET("sse2") static void copy_sse2(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	if (size < STREAM_THRESHOLD) {
+		memcpy(dst, src, size);
+		return;
+	}
+
+	size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+
+	for (; size >= 64; size -= 64, dst += 64, src += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)src);
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+		_mm_stream_si128((__m128i *)dst, a);
+		_mm_stream_si128((__m128i *)(dst + 16), b);
+		_mm_stream_si128((__m128i *)(dst + 32), c);
+		_mm_stream_si128((__m128i *)(dst + 48), d);
+	}
+	_mm_sfence();
+
+	memcpy(dst, src, size);
+}
+
+TARGET("avx2") static void copy_avx2(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	if (size < STREAM_THRESHOLD) {
+		memcpy(dst, src, size);
+		return;
+	}
+
+	size_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+
+	for (; size >= 128; size -= 128, dst += 128, src += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)src);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(src + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(src + 96));
+		_mm256_stream_si256((__m256i *)dst, a);
+		_mm256_stream_si256((__m256i *)(dst + 32), b);
+		_mm256_stream_si256((__m256i *)(dst + 64), c);
+		_mm256_stream_si256((__m256i *)(dst + 96), d);
+	}
+	_mm_sfence();
+
+	memcpy(dst, src, size);
+}
+
+static bool cpu_has_avx2(void)
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx)
+		return false;
+	if ((_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static bool cpu_has_sse2(void)
+{
+#if defined(_M_X64) || defined(__x86_64__)
+	return true;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+#endif // COPY_X86
+
+#ifdef COPY_NEON
+// Stores a pair of registers with the non-temporal hint.
+static inline void stream_pair(uint8_t *dst, uint8x16_t a, uint8x16_t b)
+{
+	__asm__ volatile("stnp %q1, %q2, [%0]" : : "r"(dst), "w"(a), "w"(b) : "memory");
+}
+
+static void copy_neon(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	if (size < STREAM_THRESHOLD) {
+		memcpy(dst, src, size);
+		return;
+	}
+
+	size_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+
+	for (; size >= 64; size -= 64, dst += 64, src += 64) {
+		uint8x16_t a = vld1q_u8(src);
+		uint8x16_t b = vld1q_u8(src + 16);
+		uint8x16_t c = vld1q_u8(src + 32);
+		uint8x16_t d = vld1q_u8(src + 48);
+		stream_pair(dst, a, b);
+		stream_pair(dst + 32, c, d);
+	}
+	__asm__ volatile("dmb ishst" : : : "memory");
+
+	memcpy(dst, src, size);
+}
+#endif
+
+static copy_fn copy_kernel = copy_memcpy;
+
+void frame_copy_init(void)
+{
+	const char *name = "memcpy";
+
+#ifdef COPY_X86
+	if (cpu_has_avx2()) {
+		copy_kernel = copy_avx2;
+		name = "avx2";
+	}
+	else if (cpu_has_sse2()) {
+		copy_kernel = copy_sse2;
+		name = "sse2";
+	}
+#elif defined(COPY_NEON)
+	copy_kernel = copy_neon;
+	name = "neon";
+#endif
+
+	blog(LOG_INFO, "frame copy kernel: %s", name);
+}
+
+// Returns the number of bytes to copy for each line of the plane, or 0 if the format is not known.
+static uint32_t plane_width_bytes(enum video_format format, int plane, uint32_t width)
+{
+	const uint32_t half = (width + 1) / 2;
+
+	switch (format) {
+	case VIDEO_FORMAT_I420:
+	case VIDEO_FORMAT_I422:
+	case VIDEO_FORMAT_I40A:
+	case VIDEO_FORMAT_I42A:
+		return (plane == 1 || plane == 2) ? half : width;
+	case VIDEO_FORMAT_NV12:
+		return plane == 1 ? half * 2 : width;
+	case VIDEO_FORMAT_I444:
+	case VIDEO_FORMAT_YUVA:
+	case VIDEO_FORMAT_Y800:
+		return width;
+	case VIDEO_FORMAT_YVYU:
+	case VIDEO_FORMAT_YUY2:
+	case VIDEO_FORMAT_UYVY:
+		return half * 4;
+	case VIDEO_FORMAT_RGBA:
+	case VIDEO_FORMAT_BGRA:
+	case VIDEO_FORMAT_BGRX:
+	case VIDEO_FORMAT_AYUV:
+		return width * 4;
+	case VIDEO_FORMAT_BGR3:
+		return width * 3;
+#if LIBOBS_API_VER >= MAKE_SEMANTIC_VERSION(28, 0, 0)
+	case VIDEO_FORMAT_I010:
+	case VIDEO_FORMAT_I210:
+		return (plane == 1 || plane == 2) ? half * 2 : width * 2;
+	case VIDEO_FORMAT_P010:
+		return plane == 1 ? half * 4 : width * 2;
+	case VIDEO_FORMAT_I412:
+	case VIDEO_FORMAT_YA2L:
+		return width * 2;
+#endif
+	default:
+		return 0;
+	}
+}
+
+static void copy_plane(uint8_t *dst, uint32_t dst_linesize, const uint8_t *src, uint32_t src_linesize,
+		       uint32_t width_bytes, uint32_t y0, uint32_t y1)
+{
+	dst += (size_t)dst_linesize * y0;
+	src += (size_t)src_linesize * y0;
+
+	if (dst_linesize == src_linesize) {
+		copy_kernel(dst, src, (size_t)src_linesize * (y1 - y0));
+		return;
+	}
+
+	if (width_bytes > dst_linesize)
+		width_bytes = dst_linesize;
+	if (width_bytes > src_linesize)
+		width_bytes = src_linesize;
+
+	for (uint32_t y = y0; y < y1; y++, dst += dst_linesize, src += src_linesize)
+		copy_kernel(dst, src, width_bytes);
+}
+
+// Copies the horizontal stripe `stripe` out of `stripes` for each plane.
+static void copy_stripe(uint8_t *const dst_data[MAX_AV_PLANES], const uint32_t dst_linesize[MAX_AV_PLANES],
+			const struct obs_source_frame *src, int stripe, int stripes)
+{
+	for (int i = 0; i < MAX_AV_PLANES; i++) {
+		if (!src->data[i] || !dst_data[i])
+			break;
+
+		uint32_t height = frame_plane_height(src->format, i, src->height);
+		uint32_t y0 = (uint32_t)((uint64_t)height * stripe / stripes);
+		uint32_t y1 = (uint32_t)((uint64_t)height * (stripe + 1) / stripes);
+
+		copy_plane(dst_data[i], dst_linesize[i], src->data[i], src->linesize[i],
+			   plane_width_bytes(src->format, i, src->width), y0, y1);
+	}
+}
+
+struct frame_copy_workers
+{
+	pthread_mutex_t busy; // held by the caller of `frame_copy_planes` and while changing the threads
+	pthread_mutex_t mutex;
+	pthread_cond_t cond_job;
+	pthread_cond_t cond_done;
+	DARRAY(pthread_t) threads;
+	bool stop;
+
+	// current job, protected by `mutex`
+	uint8_t *const *dst_data;
+	const uint32_t *dst_linesize;
+	const struct obs_source_frame *src;
+	int stripes;
+	int next_stripe;
+	int remaining;
+};
+
+// Takes and copies stripes of the current job until no stripe is left.
+// Must be called with `mutex` locked.
+static void work_stripes(struct frame_copy_workers *w)
+{
+	while (w->next_stripe < w->stripes) {
+		int stripe = w->next_stripe++;
+		pthread_mutex_unlock(&w->mutex);
+
+		copy_stripe(w->dst_data, w->dst_linesize, w->src, stripe, w->stripes);
+
+		pthread_mutex_lock(&w->mutex);
+		if (--w->remaining == 0)
+			pthread_cond_signal(&w->cond_done);
+	}
+}
+
+static void *worker_thread(void *data)
+{
+	struct frame_copy_workers *w = data;
+	os_set_thread_name("asrec-copy");
+
+	pthread_mutex_lock(&w->mutex);
+	while (!w->stop) {
+		if (w->next_stripe >= w->stripes) {
+			pthread_cond_wait(&w->cond_job, &w->mutex);
+			continue;
+		}
+		work_stripes(w);
+	}
+	pthread_mutex_unlock(&w->mutex);
+
+	return NULL;
+}
+
+static void stop_threads(struct frame_copy_workers *w)
+{
+	pthread_mutex_lock(&w->mutex);
+	w->stop = true;
+	pthread_cond_broadcast(&w->cond_job);
+	pthread_mutex_unlock(&w->mutex);
+
+	for (size_t i = 0; i < w->threads.num; i++)
+		pthread_join(w->threads.array[i], NULL);
+	da_resize(w->threads, 0);
+
+	w->stop = false;
+}
+
+struct frame_copy_workers *frame_copy_workers_create(void)
+{
+	struct frame_copy_workers *w = bzalloc(sizeof(struct frame_copy_workers));
+	pthread_mutex_init(&w->busy, NULL);
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond_job, NULL);
+	pthread_cond_init(&w->cond_done, NULL);
+	return w;
+}
+
+void frame_copy_workers_destroy(struct frame_copy_workers *w)
+{
+	if (!w)
+		return;
+
+	stop_threads(w);
+	da_free(w->threads);
+	pthread_cond_destroy(&w->cond_done);
+	pthread_cond_destroy(&w->cond_job);
+	pthread_mutex_destroy(&w->mutex);
+	pthread_mutex_destroy(&w->busy);
+	bfree(w);
+}
+
+void frame_copy_workers_set_threads(struct frame_copy_workers *w, int n_threads)
+{
+	// The caller also copies a stripe so that one less thread is created.
+	size_t n_workers = n_threads > 1 ? (size_t)(n_threads - 1) : 0;
+
+	pthread_mutex_lock(&w->busy);
+	if (n_workers != w->threads.num) {
+		stop_threads(w);
+		for (size_t i = 0; i < n_workers; i++) {
+			pthread_t thread;
+			if (pthread_create(&thread, NULL, worker_thread, w) != 0) {
+				blog(LOG_ERROR, "frame_copy_workers %p: failed to create a thread", w);
+				break;
+			}
+			da_push_back(w->threads, &thread);
+		}
+	}
+	pthread_mutex_unlock(&w->busy);
+}
+
+static bool copy_with_workers(struct frame_copy_workers *w, uint8_t *const dst_data[MAX_AV_PLANES],
+			      const uint32_t dst_linesize[MAX_AV_PLANES], const struct obs_source_frame *src)
+{
+	if (!w || frame_data_size(src) < MT_THRESHOLD)
+		return false;
+
+	// If another thread is copying or the threads are being changed, copy by this thread alone.
+	if (pthread_mutex_trylock(&w->busy) != 0)
+		return false;
+
+	if (!w->threads.num) {
+		pthread_mutex_unlock(&w->busy);
+		return false;
+	}
+
+	pthread_mutex_lock(&w->mutex);
+	w->dst_data = dst_data;
+	w->dst_linesize = dst_linesize;
+	w->src = src;
+	w->stripes = (int)w->threads.num + 1;
+	w->remaining = w->stripes;
+	w->next_stripe = 0;
+	pthread_cond_broadcast(&w->cond_job);
+
+	work_stripes(w);
+	while (w->remaining > 0)
+		pthread_cond_wait(&w->cond_done, &w->mutex);
+
+	w->stripes = 0;
+	w->next_stripe = 0;
+	pthread_mutex_unlock(&w->mutex);
+
+	pthread_mutex_unlock(&w->busy);
+	return true;
+}
+
+void frame_copy_planes(struct frame_copy_workers *workers, uint8_t *const dst_data[MAX_AV_PLANES],
+		       const uint32_t dst_linesize[MAX_AV_PLANES], const struct obs_source_frame *src)
+{
+	if (!plane_width_bytes(src->format, 0, src->width)) {
+		struct obs_source_frame tmp = {
+			.width = src->width,
+			.height = src->height,
+			.format = src->format,
+		};
+		for (int i = 0; i < MAX_AV_PLANES; i++)
+			tmp.data[i] = dst_data[i];
+		for (int i = 0; i < MAX_AV_PLANES; i++)
+			tmp.linesize[i] = dst_linesize[i];
+		obs_source_frame_copy(&tmp, src);
+		return;
+	}
+
+	if (copy_with_workers(workers, dst_data, dst_linesize, src))
+		return;
+
+	copy_stripe(dst_data, dst_linesize, src, 0, 1);
+}
+
+void frame_copy(struct frame_copy_workers *workers, struct obs_source_frame *dst, const struct obs_source_frame *src)
+{
+	// Take the properties such as timestamp and color matrix from `src` but keep the buffer of `dst`.
+	uint8_t *data[MAX_AV_PLANES];
+	uint32_t linesize[MAX_AV_PLANES];
+	memcpy(data, dst->data, sizeof(data));
+	memcpy(linesize, dst->linesize, sizeof(linesize));
+	long refs = dst->refs;
+
+	*dst = *src;
+
+	memcpy(dst->data, data, sizeof(data));
+	memcpy(dst->linesize, linesize, sizeof(linesize));
+	dst->refs = refs;
+
+	frame_copy_planes(workers, dst->data, dst->linesize, src);
+}
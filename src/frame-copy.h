@@ -0,0 +1,31 @@
+#pragma once
+
+#include <obs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Selects the copy kernel for the running CPU. Call once before using the functions below.
+void frame_copy_init(void);
+
+// Threads to copy a large frame in horizontal stripes.
+struct frame_copy_workers;
+
+struct frame_copy_workers *frame_copy_workers_create(void);
+void frame_copy_workers_destroy(struct frame_copy_workers *workers);
+
+// Sets the number of threads including the calling thread. 1 or less disables the workers.
+void frame_copy_workers_set_threads(struct frame_copy_workers *workers, int n_threads);
+
+// Copies the planes of `src` into `dst_data` whose strides are `dst_linesize`.
+// `workers` can be NULL.
+void frame_copy_planes(struct frame_copy_workers *workers, uint8_t *const dst_data[MAX_AV_PLANES],
+		       const uint32_t dst_linesize[MAX_AV_PLANES], const struct obs_source_frame *src);
+
+// Same as `obs_source_frame_copy` but the planes are copied by `frame_copy_planes`.
+void frame_copy(struct frame_copy_workers *workers, struct obs_source_frame *dst, const struct obs_source_frame *src);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,113 @@
+#include <obs-module.h>
+#include "frame-pool.h"
+#include "plugin-macros.generated.h"
+
+// Number of frames allocated when the pool is (re)built.
+#define FRAME_POOL_PREALLOC 4
+
+// By default, keep at most this number of unused frames so that a burst does not hold the memory forever.
+#define FRAME_POOL_MAX_UNUSED 16
+
+void frame_pool_init(struct frame_pool *pool)
+{
+	pthread_mutex_init(&pool->mutex, NULL);
+	da_init(pool->frames);
+	pool->format = VIDEO_FORMAT_NONE;
+	pool->width = 0;
+	pool->height = 0;
+	pool->allocated = 0;
+	pool->max_unused = FRAME_POOL_MAX_UNUSED;
+}
+
+static void destroy_unused_frames(struct frame_pool *pool)
+{
+	for (size_t i = 0; i < pool->frames.num; i++)
+		obs_source_frame_destroy(pool->frames.array[i]);
+	da_resize(pool->frames, 0);
+}
+
+void frame_pool_free(struct frame_pool *pool)
+{
+	destroy_unused_frames(pool);
+	da_free(pool->frames);
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+static inline bool frame_fits(const struct frame_pool *pool, enum video_format format, uint32_t width,
+			      uint32_t height)
+{
+	return pool->format == format && pool->width == width && pool->height == height;
+}
+
+static void rebuild(struct frame_pool *pool, enum video_format format, uint32_t width, uint32_t height)
+{
+	blog(LOG_INFO, "frame_pool %p: rebuilding format=%d width=%d height=%d", pool, (int)format, width, height);
+
+	destroy_unused_frames(pool);
+
+	pool->format = format;
+	pool->width = width;
+	pool->height = height;
+
+	for (int i = 0; i < FRAME_POOL_PREALLOC; i++) {
+		struct obs_source_frame *frame = obs_source_frame_create(format, width, height);
+		da_push_back(pool->frames, &frame);
+		os_atomic_inc_long(&pool->allocated);
+	}
+}
+
+struct obs_source_frame *frame_pool_get(struct frame_pool *pool, enum video_format format, uint32_t width,
+					uint32_t height)
+{
+	struct obs_source_frame *frame = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	if (!frame_fits(pool, format, width, height))
+		rebuild(pool, format, width, height);
+
+	if (pool->frames.num) {
+		frame = pool->frames.array[pool->frames.num - 1];
+		da_pop_back(pool->frames);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (!frame) {
+		frame = obs_source_frame_create(format, width, height);
+		os_atomic_inc_long(&pool->allocated);
+	}
+
+	frame->refs = 0;
+	return frame;
+}
+
+void frame_pool_set_max_unused(struct frame_pool *pool, size_t count)
+{
+	if (count < FRAME_POOL_MAX_UNUSED)
+		count = FRAME_POOL_MAX_UNUSED;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->max_unused = count;
+	while (pool->frames.num > count) {
+		obs_source_frame_destroy(pool->frames.array[pool->frames.num - 1]);
+		da_pop_back(pool->frames);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void frame_pool_release(struct frame_pool *pool, struct obs_source_frame *frame)
+{
+	if (!frame)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (frame_fits(pool, frame->format, frame->width, frame->height) && pool->frames.num < pool->max_unused) {
+		da_push_back(pool->frames, &frame);
+		frame = NULL;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (frame)
+		obs_source_frame_destroy(frame);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <obs.h>
+#include <util/darray.h>
+#include <util/threading.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Recycles `struct obs_source_frame` so that the video callback does not
+// allocate a full frame buffer for every incoming frame.
+struct frame_pool
+{
+	pthread_mutex_t mutex;
+	DARRAY(struct obs_source_frame *) frames; // unused frames
+	enum video_format format;
+	uint32_t width;
+	uint32_t height;
+	volatile long allocated; // frames created so far, to see that the frames are recycled
+	size_t max_unused;
+};
+
+void frame_pool_init(struct frame_pool *pool);
+void frame_pool_free(struct frame_pool *pool);
+
+// Returns a frame whose buffer fits the format and size.
+// If the format or the size differs from the previous call, the pool is rebuilt.
+struct obs_source_frame *frame_pool_get(struct frame_pool *pool, enum video_format format, uint32_t width,
+					uint32_t height);
+
+// Keeps up to `count` unused frames instead of the default, for example to refill a pre-roll of `count` frames
+// without allocating. Set 0 to restore the default. Extra unused frames are destroyed.
+void frame_pool_set_max_unused(struct frame_pool *pool, size_t count);
+
+// Gives the frame back to the pool. Frames that do not fit the current format are destroyed.
+void frame_pool_release(struct frame_pool *pool, struct obs_source_frame *frame);
+
+#ifdef __cplusplus
+}
+#endif
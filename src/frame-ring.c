@@ -0,0 +1,100 @@
+#include <obs-module.h>
+#include "frame-ring.h"
+
+#define SLOT(index) ((unsigned long)(index) & (FRAME_RING_CAPACITY - 1))
+
+void frame_ring_init(struct frame_ring *ring)
+{
+	ring->frames = bzalloc(sizeof(struct queued_frame) * FRAME_RING_CAPACITY);
+	ring->head = 0;
+	ring->tail = 0;
+	ring->consumer_waiting = false;
+	ring->producer_waiting = false;
+	os_event_init(&ring->frame_event, OS_EVENT_TYPE_AUTO);
+	os_event_init(&ring->space_event, OS_EVENT_TYPE_AUTO);
+}
+
+void frame_ring_free(struct frame_ring *ring)
+{
+	os_event_destroy(ring->frame_event);
+	os_event_destroy(ring->space_event);
+	bfree(ring->frames);
+	ring->frames = NULL;
+}
+
+bool frame_ring_push(struct frame_ring *ring, const struct queued_frame *qf)
+{
+	long head = os_atomic_load_long(&ring->head);
+	long tail = os_atomic_load_long(&ring->tail);
+
+	if ((unsigned long)head - (unsigned long)tail >= FRAME_RING_CAPACITY)
+		return false;
+
+	ring->frames[SLOT(head)] = *qf;
+	os_atomic_set_long(&ring->head, (long)((unsigned long)head + 1));
+
+	if (os_atomic_load_bool(&ring->consumer_waiting))
+		os_event_signal(ring->frame_event);
+
+	return true;
+}
+
+bool frame_ring_pop(struct frame_ring *ring, struct queued_frame *qf)
+{
+	for (;;) {
+		long tail = os_atomic_load_long(&ring->tail);
+		long head = os_atomic_load_long(&ring->head);
+		if (tail == head)
+			return false;
+
+		*qf = ring->frames[SLOT(tail)];
+		if (!os_atomic_compare_swap_long(&ring->tail, tail, (long)((unsigned long)tail + 1)))
+			continue;
+
+		if (os_atomic_load_bool(&ring->producer_waiting))
+			os_event_signal(ring->space_event);
+
+		return true;
+	}
+}
+
+bool frame_ring_peek(struct frame_ring *ring, struct queued_frame *qf)
+{
+	long tail = os_atomic_load_long(&ring->tail);
+	long head = os_atomic_load_long(&ring->head);
+	if (tail == head)
+		return false;
+	*qf = ring->frames[SLOT(tail)];
+	return true;
+}
+
+bool frame_ring_peek_at(struct frame_ring *ring, size_t index, struct queued_frame *qf)
+{
+	long tail = os_atomic_load_long(&ring->tail);
+	long head = os_atomic_load_long(&ring->head);
+	if ((unsigned long)head - (unsigned long)tail <= index)
+		return false;
+	*qf = ring->frames[SLOT((unsigned long)tail + index)];
+	return true;
+}
+
+void frame_ring_wait(struct frame_ring *ring)
+{
+	os_atomic_set_bool(&ring->consumer_waiting, true);
+	if (!frame_ring_count(ring))
+		os_event_wait(ring->frame_event);
+	os_atomic_set_bool(&ring->consumer_waiting, false);
+}
+
+void frame_ring_wake(struct frame_ring *ring)
+{
+	os_event_signal(ring->frame_event);
+}
+
+void frame_ring_wait_space(struct frame_ring *ring, size_t limit, unsigned long timeout_ms)
+{
+	os_atomic_set_bool(&ring->producer_waiting, true);
+	if (frame_ring_count(ring) >= limit)
+		os_event_timedwait(ring->space_event, timeout_ms);
+	os_atomic_set_bool(&ring->producer_waiting, false);
+}
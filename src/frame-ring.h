@@ -0,0 +1,73 @@
+#pragma once
+
+#include <obs.h>
+#include <util/threading.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Power of two. Large enough for the longest pre-roll, 60 s at 240 fps, on top of the queue.
+#define FRAME_RING_CAPACITY 16384
+
+struct queued_frame
+{
+	struct obs_source_frame *frame;
+	bool borrowed; // the frame belongs to the parent source and has to be released to it
+	uint64_t timestamp; // on the system clock of the outputs
+
+	// Copied from `frame` when it is queued. The consumer can read them from a peeked slot even if the producer
+	// drops the frame and gives it back to the pool in the meantime.
+	enum video_format format;
+	uint32_t width;
+	uint32_t height;
+	bool full_range;
+	size_t size; // bytes of the planes
+};
+
+// Lock-free ring of frames between the video callback and the record thread.
+// Only one thread may push. Popping is done by compare-and-swap on `tail` so that
+// the producer can also drop the oldest frame and the queue can be flushed from
+// another thread.
+struct frame_ring
+{
+	struct queued_frame *frames;
+	volatile long head; // next slot to write, updated only by the producer
+	volatile long tail; // next slot to read
+
+	os_event_t *frame_event; // signaled when a frame is pushed while `consumer_waiting`
+	os_event_t *space_event; // signaled when a frame is popped while `producer_waiting`
+	volatile bool consumer_waiting;
+	volatile bool producer_waiting;
+};
+
+void frame_ring_init(struct frame_ring *ring);
+void frame_ring_free(struct frame_ring *ring);
+
+static inline size_t frame_ring_count(const struct frame_ring *ring)
+{
+	unsigned long tail = (unsigned long)os_atomic_load_long(&ring->tail);
+	unsigned long head = (unsigned long)os_atomic_load_long(&ring->head);
+	return (size_t)(head - tail);
+}
+
+// Returns false if the ring is full.
+bool frame_ring_push(struct frame_ring *ring, const struct queued_frame *qf);
+
+// Returns false if the ring is empty.
+bool frame_ring_pop(struct frame_ring *ring, struct queued_frame *qf);
+bool frame_ring_peek(struct frame_ring *ring, struct queued_frame *qf);
+
+// Returns false if `index` or fewer frames are queued. Only the consumer may call this.
+bool frame_ring_peek_at(struct frame_ring *ring, size_t index, struct queued_frame *qf);
+
+// Parks the consumer until a frame is pushed or `frame_ring_wake` is called.
+void frame_ring_wait(struct frame_ring *ring);
+void frame_ring_wake(struct frame_ring *ring);
+
+// Parks the producer while `limit` or more frames are queued until a frame is popped or the timeout expires.
+void frame_ring_wait_space(struct frame_ring *ring, size_t limit, unsigned long timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <obs.h>
+
+static inline uint32_t frame_plane_height(enum video_format format, int plane, uint32_t height)
+{
+	switch (format) {
+	case VIDEO_FORMAT_I420:
+	case VIDEO_FORMAT_NV12:
+	case VIDEO_FORMAT_I40A:
+#if LIBOBS_API_VER >= MAKE_SEMANTIC_VERSION(28, 0, 0)
+	case VIDEO_FORMAT_I010:
+	case VIDEO_FORMAT_P010:
+#endif
+		return (plane == 1 || plane == 2) ? (height + 1) / 2 : height;
+	default:
+		return height;
+	}
+}
+
+static inline size_t frame_data_size(const struct obs_source_frame *frame)
+{
+	size_t size = 0;
+	for (int i = 0; i < MAX_AV_PLANES && frame->data[i]; i++)
+		size += (size_t)frame->linesize[i] * frame_plane_height(frame->format, i, frame->height);
+	return size;
+}
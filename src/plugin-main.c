@@ -19,6 +19,8 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <obs-module.h>
 
 #include "plugin-macros.generated.h"
+#include "frame-copy.h"
+#include "encoder-share.h"
 
 OBS_DECLARE_MODULE()
 OBS_MODULE_USE_DEFAULT_LOCALE(PLUGIN_NAME, "en-US")
@@ -28,11 +30,14 @@ extern const struct obs_source_info async_record_info;
 bool obs_module_load(void)
 {
 	blog(LOG_INFO, "plugin loaded successfully (version %s)", PLUGIN_VERSION);
+	frame_copy_init();
+	encoder_share_init();
 	obs_register_source(&async_record_info);
 	return true;
 }
 
 void obs_module_unload()
 {
+	encoder_share_free();
 	blog(LOG_INFO, "plugin unloaded");
 }
@@ -0,0 +1,154 @@
+#include <limits.h>
+#include <obs-module.h>
+#include <util/dstr.h>
+#include "record-stats.h"
+
+void record_stats_reset(struct record_stats *stats)
+{
+	os_atomic_set_long(&stats->received, 0);
+	os_atomic_set_long(&stats->queued, 0);
+	os_atomic_set_long(&stats->sent, 0);
+	os_atomic_set_long(&stats->dropped, 0);
+	os_atomic_set_long(&stats->duplicated, 0);
+	os_atomic_set_long(&stats->elided, 0);
+	os_atomic_set_long(&stats->queue_max, 0);
+	for (int i = 0; i < RECORD_STATS_COPY_BUCKETS; i++)
+		os_atomic_set_long(&stats->copy_hist[i], 0);
+	os_atomic_set_long(&stats->delay_us, 0);
+	os_atomic_set_long(&stats->delay_us_max, 0);
+	os_atomic_set_long(&stats->drift_us, 0);
+}
+
+static void add_long(volatile long *dst, long count)
+{
+	long prev = os_atomic_load_long(dst);
+	while (!os_atomic_compare_swap_long(dst, prev, prev + count))
+		prev = os_atomic_load_long(dst);
+}
+
+void record_stats_add_duplicated(struct record_stats *stats, long count)
+{
+	add_long(&stats->duplicated, count);
+}
+
+void record_stats_add_elided(struct record_stats *stats, long count)
+{
+	add_long(&stats->elided, count);
+}
+
+void record_stats_add_copy_time(struct record_stats *stats, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	uint64_t limit = 125;
+	int i = 0;
+	while (i < RECORD_STATS_COPY_BUCKETS - 1 && us >= limit) {
+		i++;
+		limit *= 2;
+	}
+	os_atomic_inc_long(&stats->copy_hist[i]);
+}
+
+static void set_max(volatile long *dst, long value)
+{
+	long prev = os_atomic_load_long(dst);
+	while (value > prev) {
+		if (os_atomic_compare_swap_long(dst, prev, value))
+			break;
+		prev = os_atomic_load_long(dst);
+	}
+}
+
+void record_stats_set_queue_depth(struct record_stats *stats, size_t depth)
+{
+	set_max(&stats->queue_max, (long)depth);
+}
+
+void record_stats_set_delay(struct record_stats *stats, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	long value = us > LONG_MAX ? LONG_MAX : (long)us;
+	os_atomic_set_long(&stats->delay_us, value);
+	set_max(&stats->delay_us_max, value);
+}
+
+void record_stats_set_drift(struct record_stats *stats, int64_t ns)
+{
+	int64_t us = ns / 1000;
+	long value = us > LONG_MAX ? LONG_MAX : us < LONG_MIN ? LONG_MIN : (long)us;
+	os_atomic_set_long(&stats->drift_us, value);
+}
+
+static void copy_hist_to_dstr(const struct record_stats *stats, struct dstr *str)
+{
+	for (int i = 0; i < RECORD_STATS_COPY_BUCKETS; i++) {
+		if (i)
+			dstr_cat_ch(str, ',');
+		dstr_catf(str, "%ld", os_atomic_load_long(&stats->copy_hist[i]));
+	}
+}
+
+static void add_info(obs_properties_t *props, const char *name, const char *text)
+{
+#if LIBOBS_API_VER >= MAKE_SEMANTIC_VERSION(28, 0, 0)
+	obs_properties_add_text(props, name, text, OBS_TEXT_INFO);
+#else
+	obs_property_t *prop = obs_properties_add_text(props, name, text, OBS_TEXT_DEFAULT);
+	obs_property_set_enabled(prop, false);
+#endif
+}
+
+static void add_info_long(obs_properties_t *props, const char *name, const char *desc, long value)
+{
+	struct dstr str = {0};
+	dstr_printf(&str, "%s: %ld", obs_module_text(desc), value);
+	add_info(props, name, str.array);
+	dstr_free(&str);
+}
+
+void record_stats_add_properties(const struct record_stats *stats, obs_properties_t *props)
+{
+	obs_properties_t *pp = obs_properties_create();
+
+	add_info_long(pp, "stats_received", "Received frames", os_atomic_load_long(&stats->received));
+	add_info_long(pp, "stats_queued", "Queued frames", os_atomic_load_long(&stats->queued));
+	add_info_long(pp, "stats_sent", "Sent frames", os_atomic_load_long(&stats->sent));
+	add_info_long(pp, "stats_dropped", "Dropped frames", os_atomic_load_long(&stats->dropped));
+	add_info_long(pp, "stats_duplicated", "Duplicated frames", os_atomic_load_long(&stats->duplicated));
+	add_info_long(pp, "stats_elided", "Elided frames", os_atomic_load_long(&stats->elided));
+	add_info_long(pp, "stats_queue_max", "Maximum queue depth", os_atomic_load_long(&stats->queue_max));
+	add_info_long(pp, "stats_delay_us", "Delay [us]", os_atomic_load_long(&stats->delay_us));
+	add_info_long(pp, "stats_delay_us_max", "Maximum delay [us]", os_atomic_load_long(&stats->delay_us_max));
+	add_info_long(pp, "stats_drift_us", "Clock drift [us]", os_atomic_load_long(&stats->drift_us));
+
+	struct dstr str = {0};
+	dstr_printf(&str, "%s: ", obs_module_text("Copy time histogram (<125us, <250us, ..., <32ms, more)"));
+	copy_hist_to_dstr(stats, &str);
+	add_info(pp, "stats_copy_hist", str.array);
+	dstr_free(&str);
+
+	obs_properties_add_group(props, "stats", obs_module_text("Statistics"), OBS_GROUP_NORMAL, pp);
+}
+
+const char *record_stats_proc_decl =
+	"void get_stats("
+	"out int received, out int queued, out int sent, out int dropped, out int duplicated, out int elided, "
+	"out int queue_max, out int delay_us, out int delay_us_max, out int drift_us, out string copy_hist)";
+
+void record_stats_to_calldata(const struct record_stats *stats, calldata_t *cd)
+{
+	calldata_set_int(cd, "received", os_atomic_load_long(&stats->received));
+	calldata_set_int(cd, "queued", os_atomic_load_long(&stats->queued));
+	calldata_set_int(cd, "sent", os_atomic_load_long(&stats->sent));
+	calldata_set_int(cd, "dropped", os_atomic_load_long(&stats->dropped));
+	calldata_set_int(cd, "duplicated", os_atomic_load_long(&stats->duplicated));
+	calldata_set_int(cd, "elided", os_atomic_load_long(&stats->elided));
+	calldata_set_int(cd, "queue_max", os_atomic_load_long(&stats->queue_max));
+	calldata_set_int(cd, "delay_us", os_atomic_load_long(&stats->delay_us));
+	calldata_set_int(cd, "delay_us_max", os_atomic_load_long(&stats->delay_us_max));
+	calldata_set_int(cd, "drift_us", os_atomic_load_long(&stats->drift_us));
+
+	struct dstr str = {0};
+	copy_hist_to_dstr(stats, &str);
+	calldata_set_string(cd, "copy_hist", str.array ? str.array : "");
+	dstr_free(&str);
+}
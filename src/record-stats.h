@@ -0,0 +1,44 @@
+#pragma once
+
+#include <obs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bucket `i` counts copies that took less than `125 << i` microseconds, the last bucket counts the rest.
+#define RECORD_STATS_COPY_BUCKETS 10
+
+// Counters are updated from the video thread and the record thread and read from any thread.
+struct record_stats
+{
+	volatile long received;
+	volatile long queued;
+	volatile long sent;
+	volatile long dropped;
+	volatile long duplicated;
+	volatile long elided; // frames not duplicated because the source stalled too long
+	volatile long queue_max;
+	volatile long copy_hist[RECORD_STATS_COPY_BUCKETS];
+	volatile long delay_us;
+	volatile long delay_us_max;
+	volatile long drift_us; // how much the source clock has drifted from the system clock
+};
+
+void record_stats_reset(struct record_stats *stats);
+void record_stats_add_duplicated(struct record_stats *stats, long count);
+void record_stats_add_elided(struct record_stats *stats, long count);
+void record_stats_add_copy_time(struct record_stats *stats, uint64_t ns);
+void record_stats_set_queue_depth(struct record_stats *stats, size_t depth);
+void record_stats_set_delay(struct record_stats *stats, uint64_t ns);
+void record_stats_set_drift(struct record_stats *stats, int64_t ns);
+
+void record_stats_add_properties(const struct record_stats *stats, obs_properties_t *props);
+
+// Declaration and handler for `proc_handler_add`.
+extern const char *record_stats_proc_decl;
+void record_stats_to_calldata(const struct record_stats *stats, calldata_t *cd);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,10 +1,20 @@
 #include <obs-module.h>
 #include <obs.h>
 #include <util/platform.h>
-#include <util/circlebuf.h>
 #include <util/threading.h>
 #include <util/dstr.h>
+#include <util/util_uint64.h>
 #include "media-io/video-frame.h"
+#include "media-io/video-scaler.h"
+#include "frame-pool.h"
+#include "frame-copy.h"
+#include "frame-ring.h"
+#include "frame-util.h"
+#include "record-stats.h"
+#include "audio-ring.h"
+#include "av-sync.h"
+#include "encoder-config.h"
+#include "encoder-share.h"
 #include "plugin-macros.generated.h"
 
 typedef enum async_record_state {
@@ -14,33 +24,113 @@ typedef enum async_record_state {
 	stopping,
 } async_record_state;
 
+typedef enum queue_policy {
+	queue_drop_oldest = 0,
+	queue_drop_newest,
+	queue_block,
+} queue_policy;
+
+typedef enum record_mode {
+	record_continuous = 0,
+	record_replay,
+} record_mode;
+
+typedef enum geometry_change_mode {
+	geometry_new_file = 0,
+	geometry_scale,
+} geometry_change_mode;
+
+typedef enum frame_rate_mode {
+	frame_rate_canvas = 0,
+	frame_rate_source,
+} frame_rate_mode;
+
 struct async_record
 {
 	// properties
 	char *directory;
 	char *filename_format;
 	char *extension;
+	bool fragmented;
+	int fragment_ms;
 	obs_data_t *output_data;
+	struct encoder_config encoder;
+	record_mode record_mode;
+	int replay_pre_sec;
+	int replay_post_sec;
+	int replay_max_mb;
 	bool overwrite_timestamp;
+	frame_rate_mode frame_rate_mode;
+	geometry_change_mode geometry_change;
+	bool borrow_frames;
+	bool direct_output;
+	int copy_threads;
+	int cache_size; // 0 to decide from `cache_budget`
+	size_t cache_budget;
+	int queue_max_frames;   // 0 for FRAME_RING_CAPACITY
+	size_t queue_max_bytes; // 0 for unlimited
+	queue_policy queue_policy;
+	int queue_block_ms;
+	uint64_t stall_restart_ns; // 0 to fill any stall with duplicated frames
+	uint64_t split_ns;         // 0 not to split by duration
+	uint64_t split_bytes;      // 0 not to split by size
+	uint64_t preroll_ns;       // 0 not to keep frames while not recording
+	size_t preroll_bytes;
+	bool preroll_truncated; // the pre-roll is bounded by the capacity of the queue, warned once
 
 	// internal data
 	obs_source_t *self;
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
-	struct circlebuf video_frames;
+	struct frame_ring video_frames;
+	struct frame_ring sent_frames; // borrowed frames to be given back to the parent
+	struct frame_pool frame_pool;
+	struct frame_copy_workers *copy_workers;
+	bool queue_dropping;
+	struct record_stats stats;
 	obs_output_t *output;
+	obs_output_t *prev_output; // previous segment, kept until `output` receives frames and then until it stops
+	uint64_t prev_stop_ns;     // when `prev_output` was asked to stop, 0 before
+	volatile bool prev_stopped;
+	uint64_t next_split_ns; // after a failed split, when to retry
+	obs_encoder_t *video_encoder; // for the replay buffer and `ffmpeg_muxer`, shared by the segments
+	obs_encoder_t *audio_encoder;
+	struct encoder_share *share; // set while the encoders are published to other instances
+	bool share_joined;           // `output` writes the packets of the encoders of another instance
+	volatile bool replay_requested;
+	uint64_t replay_save_ns; // when to save the replay buffer, 0 if not requested
+	obs_hotkey_id replay_hotkey;
+	obs_hotkey_id start_hotkey;
+	obs_hotkey_id stop_hotkey;
+	uint64_t segment_start_ns;
+	pthread_mutex_t video_mutex; // held while sending a frame to `video_output`
+	bool video_ready;            // protected by `video_mutex`
 	video_t *video_output;
+	video_scaler_t *scaler; // converts frames whose size or format differs from `video_output`
+	struct video_scale_info scaler_src;
+	struct queued_frame held_frame; // first frame for the rebuilt `video_output`, valid if `frame` is set
+	struct queued_frame last_frame; // last frame sent by the record thread, repeated while the output stops
+	uint64_t drain_end_ns;          // while stopping, until when to wait for a free frame of `video_output`
 	audio_t *audio_output;
 	uint64_t last_video_ns;
 	uint64_t video_frame_interval;
-	// TODO: add audio data
+	uint32_t lock_failures;
+	uint32_t lock_total;
+	struct audio_ring audio_frames; // audio from the parent, pulled by `audio_output`
+	uint64_t audio_delay_ns;        // how long `audio_output` is behind the system clock
+	bool paced;            // the recording started from the pre-roll, frames are sent behind the system clock
+	size_t preroll_frames; // frames of the pre-roll at the start, allowed in the queue on top of the limits
+	struct av_sync av_sync;
+	enum speaker_layout audio_speakers;
 	async_record_state state;
 	bool enabled;
-	bool need_restart;
-	volatile bool record;
+	volatile bool triggered; // recording is requested while the pre-roll is kept, see `start_recording`
+	volatile bool need_restart;
+	volatile bool record; // enabled, and triggered if the pre-roll is kept
 	volatile bool close;
 	volatile bool failed; // set by thread, reset when data is updated.
 	volatile bool output_stopped;
+	os_event_t *stopped_event; // signaled with `output_stopped`
 
 	pthread_t thread;
 };
@@ -60,61 +150,224 @@ char *make_filename(const char *dir, const char *fmt, const char *ext)
 	return path.array;
 }
 
-struct obs_source_frame *peek_first_frame(struct async_record *s)
+static void signal_thread(struct async_record *s)
 {
-	pthread_mutex_lock(&s->mutex);
+	pthread_cond_signal(&s->cond);
+	frame_ring_wake(&s->video_frames);
+}
+
+// Copies the first frame to be recorded into `first`. Only the fields copied from the frame may be read since the
+// producer can drop the frame at any time.
+static bool peek_first_frame(struct async_record *s, struct queued_frame *first)
+{
+	blog(LOG_INFO, "%p: waiting first frame", s);
 
 	for (;;) {
-		blog(LOG_INFO, "%p: waiting first frame", s);
 		if (s->close || !s->record || s->failed)
 			break;
 
-		if (s->video_frames.size == 0) {
-			pthread_cond_wait(&s->cond, &s->mutex);
+		pthread_mutex_lock(&s->video_mutex);
+		struct queued_frame qf = s->held_frame;
+		pthread_mutex_unlock(&s->video_mutex);
+
+		if (!qf.frame && !frame_ring_peek(&s->video_frames, &qf)) {
+			frame_ring_wait(&s->video_frames);
 			continue;
 		}
 
-		struct obs_source_frame *frame;
-		circlebuf_peek_front(&s->video_frames, &frame, sizeof(frame));
+		blog(LOG_INFO, "%p: got first frame: width=%d height=%d", s, qf.width, qf.height);
+		*first = qf;
+		return true;
+	}
 
-		pthread_mutex_unlock(&s->mutex);
+	return false;
+}
 
-		blog(LOG_INFO, "%p: got first frame: width=%d height=%d", s, frame->width, frame->height);
-		return frame;
+static void release_queued_frame(struct async_record *s, const struct queued_frame *qf)
+{
+	if (qf->borrowed) {
+		// The frame still holds the reference taken for the filter. If the parent is already gone,
+		// `obs_source_release_frame` destroys the frame when it is given no source.
+		obs_source_release_frame(obs_filter_get_parent(s->self), qf->frame);
+		return;
 	}
 
-	pthread_mutex_unlock(&s->mutex);
-	return NULL;
+	// copied from obs-replay-source/replay.c
+	if (os_atomic_dec_long(&qf->frame->refs) <= 0)
+		frame_pool_release(&s->frame_pool, qf->frame);
+}
+
+static void free_video_data(struct async_record *s)
+{
+	// The record thread sets and consumes `held_frame` under `video_mutex`.
+	pthread_mutex_lock(&s->video_mutex);
+	struct queued_frame held = s->held_frame;
+	s->held_frame.frame = NULL;
+	pthread_mutex_unlock(&s->video_mutex);
+	if (held.frame)
+		release_queued_frame(s, &held);
+
+	struct queued_frame qf;
+	while (frame_ring_pop(&s->video_frames, &qf))
+		release_queued_frame(s, &qf);
+	while (frame_ring_pop(&s->sent_frames, &qf))
+		release_queued_frame(s, &qf);
+}
+
+#define CACHE_SIZE_MIN 2
+#define CACHE_SIZE_MAX 64
+
+static size_t get_cache_size(const struct async_record *s, size_t frame_size)
+{
+	if (s->cache_size > 0)
+		return s->cache_size;
+
+	size_t cache_size = frame_size ? s->cache_budget / frame_size : CACHE_SIZE_MAX;
+	if (cache_size < CACHE_SIZE_MIN)
+		cache_size = CACHE_SIZE_MIN;
+	if (cache_size > CACHE_SIZE_MAX)
+		cache_size = CACHE_SIZE_MAX;
+	return cache_size;
+}
+
+#define RATE_DETECT_FRAMES 16
+#define RATE_DETECT_TIMEOUT_MS 1000
+
+static int cmp_uint64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Returns the median interval of the first queued frames, or 0 if not enough frames arrive in time.
+static uint64_t detect_frame_interval(struct async_record *s)
+{
+	uint64_t timeout_ns = os_gettime_ns() + RATE_DETECT_TIMEOUT_MS * 1000000ULL;
+	while (frame_ring_count(&s->video_frames) < RATE_DETECT_FRAMES && os_gettime_ns() < timeout_ns) {
+		if (s->close || !s->record)
+			return 0;
+		os_sleep_ms(10);
+	}
+
+	uint64_t intervals[RATE_DETECT_FRAMES - 1];
+	size_t n = 0;
+	struct queued_frame prev, qf;
+	if (!frame_ring_peek_at(&s->video_frames, 0, &prev))
+		return 0;
+	for (size_t i = 1; i < RATE_DETECT_FRAMES && frame_ring_peek_at(&s->video_frames, i, &qf); i++) {
+		if (qf.timestamp > prev.timestamp)
+			intervals[n++] = qf.timestamp - prev.timestamp;
+		prev = qf;
+	}
+
+	if (!n)
+		return 0;
+	qsort(intervals, n, sizeof(uint64_t), cmp_uint64);
+	return intervals[n / 2];
+}
+
+static const struct {
+	uint32_t num;
+	uint32_t den;
+} common_frame_rates[] = {
+	{24000, 1001}, {24, 1}, {25, 1}, {30000, 1001}, {30, 1},   {48, 1},  {50, 1},  {60000, 1001},
+	{60, 1},       {90, 1}, {100, 1}, {120000, 1001}, {120, 1}, {144, 1}, {240, 1},
+};
+
+static void frame_interval_to_fps(uint64_t interval, uint32_t *fps_num, uint32_t *fps_den)
+{
+	// Snap to the closest common frame rate within 1% so that the jitter of the first frames is not recorded.
+	// Rates such as 60 and 59.94 are both within 1% of each other, so the first match is not enough.
+	size_t best = 0;
+	uint64_t best_diff = UINT64_MAX;
+	for (size_t i = 0; i < sizeof(common_frame_rates) / sizeof(*common_frame_rates); i++) {
+		uint64_t common = util_mul_div64(1000000000ULL, common_frame_rates[i].den, common_frame_rates[i].num);
+		uint64_t diff = interval > common ? interval - common : common - interval;
+		if (diff * 100 < common && diff < best_diff) {
+			best = i;
+			best_diff = diff;
+		}
+	}
+
+	if (best_diff != UINT64_MAX) {
+		*fps_num = common_frame_rates[best].num;
+		*fps_den = common_frame_rates[best].den;
+		return;
+	}
+
+	*fps_num = (uint32_t)util_mul_div64(1000000000ULL, 1000, interval);
+	*fps_den = 1000;
+}
+
+// Whether the file is written by `ffmpeg_muxer` from libobs encoders. The lossless codecs are only in FFmpeg.
+static bool use_muxer(const struct async_record *s)
+{
+	return s->record_mode != record_replay && s->encoder.native && s->encoder.lossless == lossless_off;
+}
+
+// `ffmpeg_output` takes its time base from the canvas, not from `video_output`, so that only libobs encoders follow
+// the frame rate of `video_output`.
+static bool follows_output_rate(const struct async_record *s)
+{
+	return s->record_mode == record_replay || use_muxer(s);
 }
 
 static bool create_video_output(struct async_record *s)
 {
-	struct obs_source_frame *frame = peek_first_frame(s);
-	if (!frame)
+	struct queued_frame first;
+	if (!peek_first_frame(s, &first))
 		return false;
 
 	struct obs_video_info ovi = {0};
 	obs_get_video_info(&ovi);
 
 	struct video_output_info vi = {0};
-	vi.format = frame->format;
-	vi.width = frame->width;
-	vi.height = frame->height;
+	vi.format = first.format;
+	vi.width = first.width;
+	vi.height = first.height;
 	vi.fps_den = ovi.fps_den;
 	vi.fps_num = ovi.fps_num;
-	vi.cache_size = 16;               // Copied from source-record.c. Why 16?
+	vi.cache_size = get_cache_size(s, first.size);
 	vi.colorspace = VIDEO_CS_DEFAULT; // TODO: Can I get colorspace from the source?
-	vi.range = frame->full_range ? VIDEO_RANGE_FULL : VIDEO_RANGE_PARTIAL;
+	vi.range = first.full_range ? VIDEO_RANGE_FULL : VIDEO_RANGE_PARTIAL;
 	vi.name = obs_source_get_name(s->self);
+
+	if (s->frame_rate_mode == frame_rate_source && !follows_output_rate(s)) {
+		blog(LOG_WARNING, "%p: the FFmpeg output records at the frame rate of the canvas", s);
+	}
+	else if (s->frame_rate_mode == frame_rate_source) {
+		uint64_t interval = detect_frame_interval(s);
+		if (interval)
+			frame_interval_to_fps(interval, &vi.fps_num, &vi.fps_den);
+		else
+			blog(LOG_WARNING, "%p: failed to detect the frame rate of the source, using the canvas", s);
+	}
+
 	if (video_output_open(&s->video_output, &vi) != VIDEO_OUTPUT_SUCCESS)
 		return false;
 
+	blog(LOG_INFO, "%p: opened video output %ux%u %u/%u fps cache_size=%d", s, vi.width, vi.height, vi.fps_num,
+	     vi.fps_den, (int)vi.cache_size);
+
+	s->lock_failures = 0;
+	s->lock_total = 0;
 	s->last_video_ns = 0;
 	s->video_frame_interval = video_output_get_frame_time(s->video_output);
 
 	return true;
 }
 
+static void cb_prev_stopped(void *data, calldata_t *cd)
+{
+	struct async_record *s = data;
+	int code = calldata_int(cd, "code");
+	if (code != OBS_OUTPUT_SUCCESS)
+		blog(LOG_WARNING, "%p: previous segment stopped with an error code=%d", s, code);
+	s->prev_stopped = true;
+	signal_thread(s);
+}
+
 void cb_stopped(void *data, calldata_t *cd)
 {
 	struct async_record *s = data;
@@ -124,7 +377,8 @@ void cb_stopped(void *data, calldata_t *cd)
 		s->failed = true;
 	}
 	s->output_stopped = true;
-	pthread_cond_signal(&s->cond);
+	os_event_signal(s->stopped_event);
+	signal_thread(s);
 }
 
 static bool is_x264_extenstion(const char *ext)
@@ -136,6 +390,27 @@ static bool is_x264_extenstion(const char *ext)
 	return false;
 }
 
+// Lets a file from a crashed process be played up to the last fragment without remuxing it.
+// Called with `mutex` held.
+static void set_muxer_settings(const struct async_record *s, obs_data_t *data)
+{
+	if (!s->fragmented)
+		return;
+
+	struct dstr str = {0};
+	if (strcmp(s->extension, "mp4") == 0 || strcmp(s->extension, "mov") == 0 || strcmp(s->extension, "m4v") == 0)
+		dstr_printf(&str, "movflags=frag_keyframe+empty_moov+default_base_moof frag_duration=%lld",
+			    (long long)s->fragment_ms * 1000);
+	else if (strcmp(s->extension, "mkv") == 0)
+		dstr_printf(&str, "cluster_time_limit=%d", s->fragment_ms);
+	else
+		blog(LOG_WARNING, "%p: fragmented writing is not supported for extension '%s'", s, s->extension);
+
+	if (str.len)
+		obs_data_set_string(data, "muxer_settings", str.array);
+	dstr_free(&str);
+}
+
 static bool is_rgb_format(enum video_format format)
 {
 	switch (format) {
@@ -149,6 +424,294 @@ static bool is_rgb_format(enum video_format format)
 	}
 }
 
+// Audio is pulled this much behind the clock of `audio_output` so that the packets from the parent have arrived.
+#define AUDIO_PULL_DELAY_NS 300000000ULL
+
+static bool audio_input_cb(void *param, uint64_t start_ts, uint64_t end_ts, uint64_t *new_ts, uint32_t active_mixers,
+			   struct audio_output_data *mixes)
+{
+	struct async_record *s = param;
+	UNUSED_PARAMETER(end_ts);
+
+	uint64_t ts = start_ts - s->audio_delay_ns;
+	uint64_t duration = util_mul_div64(AUDIO_OUTPUT_FRAMES, 1000000000ULL, s->audio_frames.sample_rate);
+	uint64_t source_ts = av_sync_audio_window(&s->av_sync, ts, duration);
+	if (active_mixers & 1) {
+		audio_ring_pull(&s->audio_frames, mixes[0].data, AUDIO_OUTPUT_FRAMES, source_ts);
+	}
+	else {
+		float *discard[MAX_AUDIO_CHANNELS] = {0};
+		audio_ring_pull(&s->audio_frames, discard, AUDIO_OUTPUT_FRAMES, source_ts);
+	}
+
+	*new_ts = ts;
+	return true;
+}
+
+static bool create_audio_output(struct async_record *s)
+{
+	struct audio_output_info aoi = {
+		.name = obs_source_get_name(s->self),
+		.samples_per_sec = s->audio_frames.sample_rate,
+		.format = AUDIO_FORMAT_FLOAT_PLANAR,
+		.speakers = s->audio_speakers,
+		.input_callback = audio_input_cb,
+		.input_param = s,
+	};
+
+	return audio_output_open(&s->audio_output, &aoi) == AUDIO_OUTPUT_SUCCESS;
+}
+
+#define STOP_TIMEOUT_MS 5000
+
+// After a failed split, the current file is continued for this time before the next attempt.
+#define SPLIT_RETRY_MS 10000
+
+static void close_media_outputs(struct async_record *s)
+{
+	// The outputs of the other instances have to stop before the encoders go away.
+	if (s->share) {
+		encoder_share_withdraw(s->share, STOP_TIMEOUT_MS);
+		s->share = NULL;
+	}
+	s->share_joined = false;
+
+	obs_encoder_release(s->video_encoder);
+	obs_encoder_release(s->audio_encoder);
+	s->video_encoder = NULL;
+	s->audio_encoder = NULL;
+
+	if (s->video_output) {
+		blog(LOG_INFO, "%p: video_output_lock_frame failed %u times out of %u", s, s->lock_failures,
+		     s->lock_total);
+		// Frames are skipped when the encoder lags behind `video_output`.
+		uint32_t skipped = video_output_get_skipped_frames(s->video_output);
+		if (skipped)
+			blog(LOG_WARNING, "%p: %u frames out of %u were skipped by the encoder", s, skipped,
+			     video_output_get_total_frames(s->video_output));
+		video_output_close(s->video_output);
+		s->video_output = NULL;
+	}
+
+	if (s->scaler) {
+		video_scaler_destroy(s->scaler);
+		s->scaler = NULL;
+	}
+
+	if (s->audio_output) {
+		long dropped = os_atomic_load_long(&s->audio_frames.dropped_frames);
+		if (dropped)
+			blog(LOG_WARNING, "%p: %ld audio frames were dropped", s, dropped);
+		audio_output_close(s->audio_output);
+		s->audio_output = NULL;
+	}
+}
+
+static obs_output_t *create_record_output(struct async_record *s)
+{
+	pthread_mutex_lock(&s->mutex);
+	obs_data_t *data = obs_data_create();
+	char *filename = make_filename(s->directory, s->filename_format, s->extension);
+	obs_data_set_string(data, "url", filename);
+	set_muxer_settings(s, data);
+	encoder_config_apply_ffmpeg(&s->encoder, data, video_output_get_info(s->video_output));
+	bool default_encoder = !*s->encoder.video_encoder && s->encoder.lossless == lossless_off;
+	bool x264 = is_x264_extenstion(s->extension);
+	if (s->output_data)
+		obs_data_apply(data, s->output_data);
+	pthread_mutex_unlock(&s->mutex);
+
+	if (default_encoder && x264 && is_rgb_format(video_output_get_format(s->video_output)))
+		obs_data_set_string(data, "video_encoder", "libx264rgb");
+
+	blog(LOG_INFO, "%p: starting filename=%s", s, filename);
+	bfree(filename);
+
+	obs_output_t *output = obs_output_create("ffmpeg_output", "async_record", data, NULL);
+	obs_data_release(data);
+	if (!output) {
+		blog(LOG_ERROR, "%p obs_output_create failed", s);
+		return NULL;
+	}
+
+	obs_output_set_mixers(output, 1); // TODO: control from properties
+	obs_output_set_media(output, s->video_output, s->audio_output);
+	return output;
+}
+
+// Creates libobs encoders on `video_output` and `audio_output` unless they are kept from the previous segment.
+static bool create_encoders(struct async_record *s)
+{
+	if (s->video_encoder && s->audio_encoder)
+		return true;
+
+	const char *name = obs_source_get_name(s->self);
+
+	pthread_mutex_lock(&s->mutex);
+	char *id = bstrdup(s->encoder.obs_encoder);
+	obs_data_t *venc_settings = encoder_config_obs_settings(&s->encoder);
+	obs_data_t *aenc_settings = encoder_config_aac_settings(&s->encoder);
+	pthread_mutex_unlock(&s->mutex);
+
+	if (!s->video_encoder)
+		s->video_encoder = obs_video_encoder_create(id, name, venc_settings, NULL);
+	obs_data_release(venc_settings);
+
+	if (!s->audio_encoder)
+		s->audio_encoder = obs_audio_encoder_create("ffmpeg_aac", name, aenc_settings, 0, NULL);
+	obs_data_release(aenc_settings);
+
+	if (!s->video_encoder || !s->audio_encoder) {
+		blog(LOG_ERROR, "%p: failed to create encoders video=%s", s, id);
+		bfree(id);
+		return false;
+	}
+	bfree(id);
+
+	obs_encoder_set_video(s->video_encoder, s->video_output);
+	obs_encoder_set_audio(s->audio_encoder, s->audio_output);
+	return true;
+}
+
+// Creates a muxer that writes the packets of the libobs encoders to a file.
+// The encoders are attached when the output is started, see `start_muxer_output`.
+static obs_output_t *create_muxer_output(struct async_record *s)
+{
+	pthread_mutex_lock(&s->mutex);
+	obs_data_t *data = obs_data_create();
+	char *filename = make_filename(s->directory, s->filename_format, s->extension);
+	obs_data_set_string(data, "path", filename);
+	set_muxer_settings(s, data);
+	if (s->output_data)
+		obs_data_apply(data, s->output_data);
+	pthread_mutex_unlock(&s->mutex);
+
+	blog(LOG_INFO, "%p: starting filename=%s with OBS encoders", s, filename);
+	bfree(filename);
+
+	obs_output_t *output = obs_output_create("ffmpeg_muxer", "async_record", data, NULL);
+	obs_data_release(data);
+	if (!output) {
+		blog(LOG_ERROR, "%p obs_output_create failed", s);
+		return NULL;
+	}
+
+	return output;
+}
+
+// Creates a replay buffer that keeps the encoded packets of the last seconds in memory.
+static obs_output_t *create_replay_output(struct async_record *s)
+{
+	if (!create_encoders(s))
+		return NULL;
+
+	obs_data_t *data = obs_data_create();
+	pthread_mutex_lock(&s->mutex);
+	obs_data_set_string(data, "directory", s->directory);
+	obs_data_set_string(data, "format", s->filename_format);
+	obs_data_set_string(data, "extension", s->extension);
+	obs_data_set_int(data, "max_time_sec", s->replay_pre_sec + s->replay_post_sec);
+	obs_data_set_int(data, "max_size_mb", s->replay_max_mb);
+	set_muxer_settings(s, data);
+	pthread_mutex_unlock(&s->mutex);
+	obs_data_set_bool(data, "allow_spaces", true);
+
+	blog(LOG_INFO, "%p: starting replay buffer", s);
+	obs_output_t *output = obs_output_create("replay_buffer", "async_record_replay", data, NULL);
+	obs_data_release(data);
+	if (!output) {
+		blog(LOG_ERROR, "%p obs_output_create failed", s);
+		return NULL;
+	}
+
+	obs_output_set_video_encoder(output, s->video_encoder);
+	obs_output_set_audio_encoder(output, s->audio_encoder, 0);
+	return output;
+}
+
+// Identifies the source, the geometry and the encoder settings for `encoder_share`.
+static void get_share_key(struct async_record *s, struct dstr *key)
+{
+	const struct video_output_info *voi = video_output_get_info(s->video_output);
+	dstr_printf(key, "%p %ux%u format=%d fps=%u/%u ", obs_filter_get_parent(s->self), voi->width, voi->height,
+		    (int)voi->format, voi->fps_num, voi->fps_den);
+
+	pthread_mutex_lock(&s->mutex);
+	encoder_config_signature(&s->encoder, key);
+	pthread_mutex_unlock(&s->mutex);
+}
+
+// Starts `output` from the encoders of another instance if they are shared, otherwise from the own encoders, which
+// are then published if sharing is enabled.
+static bool start_muxer_output(struct async_record *s, obs_output_t *output)
+{
+	struct dstr key = {0};
+	if (s->encoder.share)
+		get_share_key(s, &key);
+
+	if (key.len && !s->video_encoder) {
+		if (encoder_share_join(key.array, output)) {
+			s->share_joined = true;
+			dstr_free(&key);
+			return true;
+		}
+		// Segments of one recording are not mixed between shared and own encoders.
+		if (s->share_joined) {
+			dstr_free(&key);
+			return false;
+		}
+	}
+
+	bool started = false;
+	if (create_encoders(s)) {
+		obs_output_set_video_encoder(output, s->video_encoder);
+		obs_output_set_audio_encoder(output, s->audio_encoder, 0);
+		started = obs_output_start(output);
+	}
+
+	if (started && key.len && !s->share)
+		s->share = encoder_share_publish(key.array, s->video_encoder, s->audio_encoder);
+
+	dstr_free(&key);
+	return started;
+}
+
+static void release_output(struct async_record *s, obs_output_t *output)
+{
+	if (s->share_joined)
+		encoder_share_leave(output);
+	obs_output_release(output);
+}
+
+// Creates and starts an output that writes a new file from `video_output` and `audio_output`.
+static obs_output_t *start_output(struct async_record *s)
+{
+	obs_output_t *output;
+	if (s->record_mode == record_replay)
+		output = create_replay_output(s);
+	else if (use_muxer(s))
+		output = create_muxer_output(s);
+	else
+		output = create_record_output(s);
+	if (!output)
+		return NULL;
+
+	signal_handler_t *sh = obs_output_get_signal_handler(output);
+	signal_handler_connect(sh, "stop", cb_stopped, s);
+
+	if (!(use_muxer(s) ? start_muxer_output(s, output) : obs_output_start(output))) {
+		blog(LOG_ERROR, "%p obs_output_start failed", s);
+		signal_handler_disconnect(sh, "stop", cb_stopped, s);
+		obs_output_release(output);
+		return NULL;
+	}
+
+	s->segment_start_ns = os_gettime_ns();
+	s->replay_requested = false;
+	s->replay_save_ns = 0;
+	return output;
+}
+
 static bool thread_start_loop(struct async_record *s)
 {
 	pthread_mutex_lock(&s->mutex);
@@ -162,18 +725,15 @@ static bool thread_start_loop(struct async_record *s)
 		}
 
 		if (!s->record || s->failed) {
+			// Frames left after the previous recording are not needed any more,
+			// unless they are kept for the pre-roll.
+			if (!s->preroll_ns)
+				free_video_data(s);
 			pthread_cond_wait(&s->cond, &s->mutex);
 			continue;
 		}
 
 		s->state = starting;
-
-		obs_data_t *data = obs_data_create();
-		char *filename = make_filename(s->directory, s->filename_format, s->extension);
-		obs_data_set_string(data, "url", filename);
-		if (s->output_data)
-			obs_data_apply(data, s->output_data);
-
 		s->need_restart = false;
 
 		pthread_mutex_unlock(&s->mutex);
@@ -184,38 +744,40 @@ static bool thread_start_loop(struct async_record *s)
 			continue;
 		}
 
-		// TODO: implement settings
-		obs_data_set_int(data, "video_bitrate", 2500);
-		obs_data_set_int(data, "audio_bitrate", 320);
-
-		// TODO: let users to choose
-		if (is_x264_extenstion(s->extension) && is_rgb_format(video_output_get_format(s->video_output)))
-			obs_data_set_string(data, "video_encoder", "libx264rgb");
-
-		blog(LOG_INFO, "%p: starting filename=%s", s, filename);
-		bfree(filename);
-
-		obs_output_t *output = obs_output_create("ffmpeg_output", "async_record", data, NULL);
-		obs_data_release(data);
-		if (!output) {
-			blog(LOG_ERROR, "%p obs_output_create failed", s);
+		// Start the audio at the first frame, which is older than usual if it is from the pre-roll.
+		s->audio_delay_ns = AUDIO_PULL_DELAY_NS;
+		struct queued_frame first;
+		uint64_t now = os_gettime_ns();
+		if (s->preroll_ns && frame_ring_peek(&s->video_frames, &first) &&
+		    now > first.timestamp + s->audio_delay_ns)
+			s->audio_delay_ns = now - first.timestamp;
+
+		// The video stays behind by the pre-roll for the whole file, so the queue holds the pre-roll.
+		s->paced = s->audio_delay_ns > AUDIO_PULL_DELAY_NS;
+		s->preroll_frames = s->paced ? frame_ring_count(&s->video_frames) : 0;
+		// The frames given back while recording are kept to refill the pre-roll after it without allocating.
+		if (s->paced)
+			frame_pool_set_max_unused(&s->frame_pool, s->preroll_frames);
+		if (s->paced)
+			blog(LOG_INFO, "%p: starting with %zu frames of pre-roll, %.3f s", s, s->preroll_frames,
+			     s->audio_delay_ns * 1e-9);
+
+		if (!create_audio_output(s)) {
+			blog(LOG_ERROR, "%p create_audio_output failed", s);
+			close_media_outputs(s);
 			pthread_mutex_lock(&s->mutex);
 			s->failed = true;
 			continue;
 		}
 
 		s->output_stopped = false;
-		signal_handler_t *sh = obs_output_get_signal_handler(output);
-		signal_handler_connect(sh, "stop", cb_stopped, s);
-
-		obs_output_set_mixers(output, 1); // TODO: control from properties
-		obs_output_set_media(output, s->video_output, obs_get_audio());
-
-		if (!output || !obs_output_start(output)) {
-			blog(LOG_ERROR, "%p obs_output_start failed", s);
-			obs_output_release(output);
-			s->failed = true;
+		os_event_reset(s->stopped_event);
+		s->next_split_ns = 0;
+		obs_output_t *output = start_output(s);
+		if (!output) {
+			close_media_outputs(s);
 			pthread_mutex_lock(&s->mutex);
+			s->failed = true;
 			continue;
 		}
 
@@ -224,59 +786,132 @@ static bool thread_start_loop(struct async_record *s)
 	}
 }
 
-static void copy_frame_to_output(struct video_frame *dst, const struct obs_source_frame *src)
+static void copy_frame_to_output(struct async_record *s, struct video_frame *dst, const struct obs_source_frame *src)
 {
-	struct obs_source_frame tmp = {
-		.width = src->width,
-		.height = src->height,
-		.format = src->format,
-	};
-	for (int i = 0; i < MAX_AV_PLANES; i++)
-		tmp.data[i] = dst->data[i];
-	for (int i = 0; i < MAX_AV_PLANES; i++)
-		tmp.linesize[i] = dst->linesize[i];
+	uint64_t start_ns = os_gettime_ns();
 
-	// Use `obs_source_frame_copy` instead of `video_frame_copy` since it
-	// does not care the difference of `linesize`.
+	// Don't use `video_frame_copy` since it does not care the difference of `linesize`.
+	frame_copy_planes(s->copy_workers, dst->data, dst->linesize, src);
 
-	obs_source_frame_copy(&tmp, src);
-	return;
+	record_stats_add_copy_time(&s->stats, os_gettime_ns() - start_ns);
 }
 
-static void send_video(struct async_record *s, struct obs_source_frame *frame)
+static bool frame_matches_output(const struct async_record *s, const struct obs_source_frame *frame)
 {
-	if (!s->video_output || video_output_stopped(s->video_output)) {
-		blog(LOG_ERROR, "%p: video_output is unavailable", s);
-		return;
+	const struct video_output_info *info = video_output_get_info(s->video_output);
+	return frame->format == info->format && frame->width == info->width && frame->height == info->height;
+}
+
+// Returns a scaler from the geometry of `frame` to `video_output`, or NULL if the conversion is not supported.
+static video_scaler_t *get_scaler(struct async_record *s, const struct obs_source_frame *frame)
+{
+	struct video_scale_info src = {
+		.format = frame->format,
+		.width = frame->width,
+		.height = frame->height,
+		.range = frame->full_range ? VIDEO_RANGE_FULL : VIDEO_RANGE_PARTIAL,
+		.colorspace = VIDEO_CS_DEFAULT,
+	};
+	if (s->scaler && memcmp(&src, &s->scaler_src, sizeof(src)) == 0)
+		return s->scaler;
+
+	if (s->scaler) {
+		video_scaler_destroy(s->scaler);
+		s->scaler = NULL;
 	}
 
 	const struct video_output_info *info = video_output_get_info(s->video_output);
-	if (frame->width != info->width) {
-		blog(LOG_INFO, "%p frame width mismatch, got %d, expected %d", s, frame->width, info->width);
+	struct video_scale_info dst = {
+		.format = info->format,
+		.width = info->width,
+		.height = info->height,
+		.range = info->range,
+		.colorspace = info->colorspace,
+	};
+	if (video_scaler_create(&s->scaler, &dst, &src, VIDEO_SCALE_FAST_BILINEAR) != VIDEO_SCALER_SUCCESS) {
+		blog(LOG_WARNING, "%p: cannot scale %ux%u format=%d to %ux%u format=%d", s, src.width, src.height,
+		     (int)src.format, dst.width, dst.height, (int)dst.format);
+		s->scaler = NULL;
+		return NULL;
 	}
-	if (frame->height != info->height) {
-		blog(LOG_INFO, "%p frame height mismatch, got %d, expected %d", s, frame->height, info->height);
+
+	blog(LOG_INFO, "%p: scaling %ux%u format=%d to %ux%u format=%d", s, src.width, src.height, (int)src.format,
+	     dst.width, dst.height, (int)dst.format);
+	s->scaler_src = src;
+	return s->scaler;
+}
+
+// Returns false if `video_output` has to be rebuilt for the frame.
+static bool frame_fits_output(struct async_record *s, const struct obs_source_frame *frame)
+{
+	if (frame_matches_output(s, frame))
+		return true;
+	return s->geometry_change == geometry_scale && get_scaler(s, frame);
+}
+
+// Returns the number of frames to be duplicated before the frame at `timestamp` if the source has stalled so long
+// that a new file should be started with the frame instead, otherwise 0.
+static uint64_t stalled_frames(const struct async_record *s, uint64_t timestamp)
+{
+	if (!s->stall_restart_ns || !s->last_video_ns)
+		return 0;
+
+	uint64_t half = s->video_frame_interval / 2;
+	if (timestamp + half <= s->last_video_ns)
+		return 0;
+	uint64_t count = (timestamp + half - s->last_video_ns) / s->video_frame_interval;
+	if (count <= 1 || (count - 1) * s->video_frame_interval <= s->stall_restart_ns)
+		return 0;
+	return count - 1;
+}
+
+// `timestamp` is the time of the frame on the system clock.
+// The frame has to fit `video_output`, see `frame_fits_output`, and must not follow a stall, see `stalled_frames`.
+// Returns false if `video_output` had no free frame. Then the frame is not counted as dropped and the output grid is
+// not advanced so that the caller can queue the frame or drop it.
+static bool send_video(struct async_record *s, struct obs_source_frame *frame, uint64_t timestamp)
+{
+	// The instance that shares its encoders sends the same frames.
+	if (s->share_joined)
+		return true;
+
+	if (!s->video_output || video_output_stopped(s->video_output)) {
+		blog(LOG_ERROR, "%p: video_output is unavailable", s);
+		return true;
 	}
-	if (frame->format != info->format) {
-		blog(LOG_INFO, "%p frame format mismatch, got %d, expected %d", s, (int)frame->format,
-		     (int)info->format);
+
+	video_scaler_t *scaler = NULL;
+	if (!frame_matches_output(s, frame)) {
+		scaler = get_scaler(s, frame);
+		if (!scaler) {
+			os_atomic_inc_long(&s->stats.dropped);
+			return true;
+		}
 	}
 
 	int count;
-	uint64_t ts = frame->timestamp;
+	uint64_t ts = timestamp;
+	uint64_t last_video_ns = s->last_video_ns;
 	if (!s->last_video_ns) {
 		count = 1;
 		s->last_video_ns = ts;
 	}
 	else {
-		count = (int)((ts - s->last_video_ns) / s->video_frame_interval);
+		// Round to the nearest point on the grid so that the jitter of a source at the output rate
+		// does not cause a drop followed by a duplicate.
+		uint64_t half = s->video_frame_interval / 2;
+		if (ts + half > s->last_video_ns)
+			count = (int)((ts + half - s->last_video_ns) / s->video_frame_interval);
+		else
+			count = 0;
 
 		s->last_video_ns += count * s->video_frame_interval;
 		ts = s->last_video_ns;
 
 		if (count <= 0) {
 			blog(LOG_WARNING, "%p: too many frames received at timestamp=%.3f", s, frame->timestamp * 1e-9);
-			return;
+			os_atomic_inc_long(&s->stats.dropped);
+			return true;
 		}
 	}
 
@@ -285,66 +920,360 @@ static void send_video(struct async_record *s, struct obs_source_frame *frame)
 		blog(LOG_INFO, "%p count=%d frame.timestamp=%.3f ts=%.3f", s, count, frame->timestamp * 1e-9,
 		     ts * 1e-9);
 	}
+	s->lock_total++;
 	if (!video_output_lock_frame(s->video_output, &output_frame, count, ts)) {
-		blog(LOG_ERROR, "%p: video_output_lock_frame failed timestamp=%.3f", s, frame->timestamp * 1e-9);
-		return;
+		// A full cache is expected while the pre-roll is sent or while stopping, see `wait_free_frame`.
+		s->lock_failures++;
+		if (!s->paced && !s->drain_end_ns)
+			blog(LOG_ERROR, "%p: video_output_lock_frame failed timestamp=%.3f failures=%u", s,
+			     frame->timestamp * 1e-9, s->lock_failures);
+		s->last_video_ns = last_video_ns;
+		return false;
 	}
 
-	copy_frame_to_output(&output_frame, frame);
+	if (scaler) {
+		uint64_t start_ns = os_gettime_ns();
+		video_scaler_scale(scaler, output_frame.data, output_frame.linesize,
+				   (const uint8_t *const *)frame->data, frame->linesize);
+		record_stats_add_copy_time(&s->stats, os_gettime_ns() - start_ns);
+	}
+	else {
+		copy_frame_to_output(s, &output_frame, frame);
+	}
 
 	video_output_unlock_frame(s->video_output);
+
+	os_atomic_inc_long(&s->stats.sent);
+	if (count > 1)
+		record_stats_add_duplicated(&s->stats, count - 1);
+	uint64_t now = os_gettime_ns();
+	record_stats_set_delay(&s->stats, now > timestamp ? now - timestamp : 0);
+	return true;
 }
 
-static void thread_main_loop(struct async_record *s)
+static void set_video_ready(struct async_record *s, bool ready)
 {
-	pthread_mutex_lock(&s->mutex);
+	pthread_mutex_lock(&s->video_mutex);
+	s->video_ready = ready;
+	pthread_mutex_unlock(&s->video_mutex);
+}
+
+// How long to wait for a free cache frame of `video_output` while sending the pre-roll, in frame intervals.
+#define PACE_MAX_INTERVALS 8
+
+// Returns true to wait for a free cache frame of `video_output` instead of dropping the frame.
+static bool wait_free_frame(const struct async_record *s, int attempt)
+{
+	if (s->close)
+		return false;
+	// The queued frames are the last moment of the file, see `drain_queue`.
+	if (s->drain_end_ns)
+		return os_gettime_ns() < s->drain_end_ns;
+	return s->paced && attempt < PACE_MAX_INTERVALS;
+}
+
+static void retire_frame(struct async_record *s, const struct queued_frame *qf)
+{
+	if (qf->borrowed)
+		frame_ring_push(&s->sent_frames, qf);
+	else
+		frame_pool_release(&s->frame_pool, qf->frame);
+}
+
+// Returns false if no frame is queued or if `video_output` has to be rebuilt.
+static bool send_next_frame(struct async_record *s)
+{
+	// Hold `video_mutex` from pop to send so that the video thread cannot send a newer frame in between.
+	pthread_mutex_lock(&s->video_mutex);
+	struct queued_frame qf;
+	bool popped = false;
+	if (s->held_frame.frame) {
+		qf = s->held_frame;
+		s->held_frame.frame = NULL;
+		popped = true;
+	}
+	else {
+		popped = frame_ring_pop(&s->video_frames, &qf);
+	}
+
+	bool fits = popped && frame_fits_output(s, qf.frame);
+	uint64_t stalled = fits ? stalled_frames(s, qf.timestamp) : 0;
+	bool sent = false;
+	if (fits && !stalled) {
+		sent = send_video(s, qf.frame, qf.timestamp);
+
+		// The pre-roll is queued at once and fills the cache of `video_output` faster than the encoder takes
+		// the frames, so wait for a free cache frame while the encoder catches up instead of dropping them.
+		for (int i = 0; !sent && wait_free_frame(s, i); i++) {
+			// The held frame keeps the video thread from sending a newer frame meanwhile.
+			s->held_frame = qf;
+			pthread_mutex_unlock(&s->video_mutex);
+			os_sleepto_ns(os_gettime_ns() + s->video_frame_interval);
+			pthread_mutex_lock(&s->video_mutex);
+			if (s->held_frame.frame != qf.frame) {
+				// Released by `free_video_data`.
+				pthread_mutex_unlock(&s->video_mutex);
+				return false;
+			}
+			s->held_frame.frame = NULL;
+			sent = send_video(s, qf.frame, qf.timestamp);
+		}
+
+		if (!sent)
+			os_atomic_inc_long(&s->stats.dropped);
+	}
+	else if (popped) {
+		s->held_frame = qf;
+	}
+	pthread_mutex_unlock(&s->video_mutex);
+
+	if (!popped)
+		return false;
+
+	if (stalled) {
+		// Don't let the encoder spend time on a frozen picture, start a new file with this frame.
+		blog(LOG_INFO, "%p: source stalled for %.3f s, starting a new file", s,
+		     stalled * s->video_frame_interval * 1e-9);
+		record_stats_add_elided(&s->stats, (long)stalled);
+		s->need_restart = true;
+		return false;
+	}
+
+	if (!fits) {
+		// Keep the frame to open the next file with it.
+		blog(LOG_INFO, "%p: frame changed to %ux%u format=%d, starting a new file", s, qf.frame->width,
+		     qf.frame->height, (int)qf.frame->format);
+		s->need_restart = true;
+		return false;
+	}
+
+	if (sent) {
+		// Keep the frame to repeat it while the output stops, see `feed_until_stopped`.
+		struct queued_frame last = s->last_frame;
+		s->last_frame = qf;
+		qf = last;
+	}
+	if (qf.frame)
+		retire_frame(s, &qf);
+	return true;
+}
+
+static bool segment_full(struct async_record *s)
+{
+	// The replay buffer bounds itself.
+	if (s->record_mode == record_replay)
+		return false;
+
+	if (s->next_split_ns && os_gettime_ns() < s->next_split_ns)
+		return false;
+	if (s->split_ns && os_gettime_ns() - s->segment_start_ns >= s->split_ns)
+		return true;
+	if (s->split_bytes && obs_output_get_total_bytes(s->output) >= s->split_bytes)
+		return true;
+	return false;
+}
+
+// Starts the next segment while the current one keeps running so that no frame is missed.
+static void begin_split(struct async_record *s)
+{
+	blog(LOG_INFO, "%p: splitting file", s);
+
+	obs_output_t *output = start_output(s);
+	if (!output) {
+		// Continue the current file and retry later, for the split by size as well.
+		s->next_split_ns = os_gettime_ns() + SPLIT_RETRY_MS * 1000000ULL;
+		return;
+	}
+	s->next_split_ns = 0;
+
+	// The current output becomes the previous segment, whose stop does not end the recording.
+	obs_output_t *prev = s->output;
+	signal_handler_t *sh = obs_output_get_signal_handler(prev);
+	s->prev_stopped = false;
+	s->prev_stop_ns = 0;
+	signal_handler_disconnect(sh, "stop", cb_stopped, s);
+	signal_handler_connect(sh, "stop", cb_prev_stopped, s);
+
+	s->prev_output = prev;
+	s->output = output;
+}
+
+// With the encoders shared by the segments, the next segment starts at a keyframe so that the previous one is kept
+// until the first packet is written.
+static bool segment_started(struct async_record *s)
+{
+	if (!obs_output_active(s->output))
+		return false;
+	if (use_muxer(s))
+		return obs_output_get_total_bytes(s->output) > 0;
+	return true;
+}
+
+// Stops the previous segment once the next one has started to receive frames.
+// It is released after it has stopped, see `release_prev_output`, so that the frames still in its encoder are written.
+static void finish_split(struct async_record *s)
+{
+	s->prev_stop_ns = os_gettime_ns();
+	obs_output_stop(s->prev_output);
+}
+
+static bool prev_output_done(const struct async_record *s)
+{
+	return s->prev_stopped || os_gettime_ns() - s->prev_stop_ns >= STOP_TIMEOUT_MS * 1000000ULL;
+}
+
+static void release_prev_output(struct async_record *s)
+{
+	obs_output_t *prev = s->prev_output;
+	if (!s->prev_stopped) {
+		blog(LOG_WARNING, "%p: previous segment did not stop in time, forcing to stop", s);
+		obs_output_force_stop(prev);
+	}
+
+	signal_handler_t *sh = obs_output_get_signal_handler(prev);
+	signal_handler_disconnect(sh, "stop", cb_prev_stopped, s);
+	release_output(s, prev);
+	s->prev_output = NULL;
+	s->prev_stop_ns = 0;
+}
+
+// Saves the replay buffer once the frames after the request have been recorded.
+static void process_replay(struct async_record *s)
+{
+	if (s->replay_requested) {
+		s->replay_requested = false;
+		if (!s->replay_save_ns)
+			s->replay_save_ns = os_gettime_ns() + (uint64_t)s->replay_post_sec * 1000000000;
+	}
+
+	if (!s->replay_save_ns || os_gettime_ns() < s->replay_save_ns)
+		return;
+
+	blog(LOG_INFO, "%p: saving replay buffer", s);
+	s->replay_save_ns = 0;
+	proc_handler_t *ph = obs_output_get_proc_handler(s->output);
+	calldata_t cd = {0};
+	proc_handler_call(ph, "save", &cd);
+	calldata_free(&cd);
+}
+
+// Returns true if the queued frames are to be drained into the file.
+static bool thread_main_loop(struct async_record *s)
+{
+	s->state = running;
+	set_video_ready(s, true);
 	for (;;) {
-		s->state = running;
 		if (s->close || !s->record || s->need_restart || s->output_stopped) {
 			break;
 		}
 
-		if (s->video_frames.size == 0) {
-			pthread_cond_wait(&s->cond, &s->mutex);
-			continue;
+		if (s->prev_output && s->prev_stop_ns) {
+			if (prev_output_done(s))
+				release_prev_output(s);
+		}
+		else if (s->prev_output && segment_started(s)) {
+			finish_split(s);
+		}
+		else if (!s->prev_output && segment_full(s)) {
+			begin_split(s);
 		}
 
-		// TODO: move send_video to the video thread (async_record_video)
-		struct obs_source_frame *frame;
-		circlebuf_pop_front(&s->video_frames, &frame, sizeof(frame));
+		if (s->record_mode == record_replay)
+			process_replay(s);
 
-		pthread_mutex_unlock(&s->mutex);
+		if (!send_next_frame(s) && !s->need_restart)
+			frame_ring_wait(&s->video_frames);
+	}
+	set_video_ready(s, false);
 
-		send_video(s, frame);
-		obs_source_frame_destroy(frame);
+	pthread_mutex_lock(&s->video_mutex);
+	bool held = s->held_frame.frame != NULL;
+	pthread_mutex_unlock(&s->video_mutex);
 
-		pthread_mutex_lock(&s->mutex);
+	// Frames after a change of the resolution or a stall are not for this file.
+	return !s->close && !s->output_stopped && !held;
+}
+
+// Sends the frames queued before the stop so that the last moment is recorded.
+// Frames arriving from now on belong to the next file.
+static void drain_queue(struct async_record *s)
+{
+	size_t n = frame_ring_count(&s->video_frames);
+	size_t drained = 0;
+	while (drained < n && os_gettime_ns() < s->drain_end_ns && send_next_frame(s))
+		drained++;
+	if (drained)
+		blog(LOG_INFO, "%p: drained %zu frames", s, drained);
+}
+
+static void release_last_frame(struct async_record *s)
+{
+	if (s->last_frame.frame)
+		release_queued_frame(s, &s->last_frame);
+	s->last_frame.frame = NULL;
+}
+
+// Repeats the last frame on the grid until the output and the previous segment stop.
+static void feed_until_stopped(struct async_record *s)
+{
+	uint32_t interval_ms = (uint32_t)(s->video_frame_interval / 1000000);
+	if (!interval_ms)
+		interval_ms = 1;
+
+	while ((!s->output_stopped || (s->prev_output && !s->prev_stopped)) && os_gettime_ns() < s->drain_end_ns) {
+		if (s->last_frame.frame && s->last_video_ns) {
+			pthread_mutex_lock(&s->video_mutex);
+			send_video(s, s->last_frame.frame, s->last_video_ns + s->video_frame_interval);
+			pthread_mutex_unlock(&s->video_mutex);
+		}
+		if (!s->output_stopped)
+			os_event_timedwait(s->stopped_event, interval_ms);
+		else
+			os_sleep_ms(interval_ms);
 	}
-	pthread_mutex_unlock(&s->mutex);
 }
 
-static void thread_close_loop(struct async_record *s)
+static void thread_close_loop(struct async_record *s, bool drain)
 {
 	blog(LOG_INFO, "%p: closing output", s);
 	if (!s->output)
 		return;
 
 	blog(LOG_INFO, "%p: stopping", s);
-	// obs_output_stop(s->output);
-	// TODO: gracely stop and wait
+	s->state = stopping;
+	if (s->replay_save_ns)
+		blog(LOG_WARNING, "%p: replay buffer is stopped before it is saved", s);
+	if (s->prev_output && !s->prev_stop_ns)
+		finish_split(s);
+
+	// Let the output flush the encoder and finalize the file. The outputs finish at the first packet after the
+	// stop time and the interleaver holds the audio until a later video packet exists, so the frames keep
+	// flowing until the output has stopped. The frames queued behind the pre-roll are late by it.
+	s->drain_end_ns = os_gettime_ns() + STOP_TIMEOUT_MS * 1000000ULL;
+	if (s->paced)
+		s->drain_end_ns += s->audio_delay_ns;
+	if (!s->output_stopped) {
+		obs_output_stop(s->output);
+		if (drain)
+			drain_queue(s);
+	}
+	feed_until_stopped(s);
+	s->drain_end_ns = 0;
 
+	if (s->prev_output)
+		release_prev_output(s);
 	if (!s->output_stopped) {
+		blog(LOG_WARNING, "%p: output did not stop in time, forcing to stop", s);
 		obs_output_force_stop(s->output);
 	}
 
-	obs_output_release(s->output);
+	release_output(s, s->output);
 
-	if (s->video_output) {
-		video_output_close(s->video_output);
-		s->video_output = NULL;
-	}
+	close_media_outputs(s);
 
 	s->output = NULL;
+
+	release_last_frame(s);
 }
 
 static void *async_record_thread(void *data)
@@ -356,9 +1285,9 @@ static void *async_record_thread(void *data)
 		if (!thread_start_loop(s))
 			break;
 
-		thread_main_loop(s);
+		bool drain = thread_main_loop(s);
 
-		thread_close_loop(s);
+		thread_close_loop(s, drain);
 	}
 
 	blog(LOG_INFO, "%p: exiting thread", s);
@@ -372,23 +1301,65 @@ static const char *async_record_name(void *unused)
 	return obs_module_text("Asynchronous Source Record");
 }
 
-static void free_video_data(struct async_record *s)
+static void request_replay(struct async_record *s)
 {
-	// copied from obs-replay-source/replay.c
-
-	while (s->video_frames.size) {
-		struct obs_source_frame *frame;
+	if (s->record_mode != record_replay)
+		return;
+	s->replay_requested = true;
+	frame_ring_wake(&s->video_frames);
+}
 
-		circlebuf_pop_front(&s->video_frames, &frame, sizeof(frame));
+static bool save_replay_clicked(obs_properties_t *props, obs_property_t *property, void *data)
+{
+	UNUSED_PARAMETER(props);
+	UNUSED_PARAMETER(property);
+	request_replay(data);
+	return false;
+}
 
-		if (os_atomic_dec_long(&frame->refs) <= 0)
-			obs_source_frame_destroy(frame);
+// With the pre-roll, the enabled filter keeps the last frames and records from them once this is set.
+// libobs does not pass the frames to a disabled filter, so the filter itself cannot be the trigger.
+static void set_triggered(struct async_record *s, bool triggered)
+{
+	if (triggered && !s->preroll_ns) {
+		blog(LOG_INFO, "%p: recording is not triggered without pre-roll, enable the filter instead", s);
+		return;
 	}
+	s->triggered = triggered;
 }
 
-static obs_properties_t *async_record_get_properties(void *unused)
+static bool start_recording_clicked(obs_properties_t *props, obs_property_t *property, void *data)
 {
-	UNUSED_PARAMETER(unused);
+	UNUSED_PARAMETER(props);
+	UNUSED_PARAMETER(property);
+	set_triggered(data, true);
+	return false;
+}
+
+static bool stop_recording_clicked(obs_properties_t *props, obs_property_t *property, void *data)
+{
+	UNUSED_PARAMETER(props);
+	UNUSED_PARAMETER(property);
+	set_triggered(data, false);
+	return false;
+}
+
+static bool record_mode_modified(obs_properties_t *props, obs_property_t *property, obs_data_t *settings)
+{
+	UNUSED_PARAMETER(property);
+	bool replay = obs_data_get_int(settings, "record_mode") == record_replay;
+	obs_property_set_visible(obs_properties_get(props, "replay_pre_sec"), replay);
+	obs_property_set_visible(obs_properties_get(props, "replay_post_sec"), replay);
+	obs_property_set_visible(obs_properties_get(props, "replay_max_mb"), replay);
+	obs_property_set_visible(obs_properties_get(props, "save_replay"), replay);
+	obs_property_set_visible(obs_properties_get(props, "split_minutes"), !replay);
+	obs_property_set_visible(obs_properties_get(props, "split_mb"), !replay);
+	return true;
+}
+
+static obs_properties_t *async_record_get_properties(void *data)
+{
+	struct async_record *s = data;
 	obs_properties_t *props;
 	obs_property_t *prop;
 
@@ -398,14 +1369,140 @@ static obs_properties_t *async_record_get_properties(void *unused)
 				       NULL);
 	prop = obs_properties_add_text(props, "filename_format", obs_module_text("Filename format"), OBS_TEXT_DEFAULT);
 	prop = obs_properties_add_text(props, "extension", obs_module_text("Extension"), OBS_TEXT_DEFAULT);
+	prop = obs_properties_add_bool(props, "fragmented", obs_module_text("Write fragmented file"));
+	obs_property_set_long_description(
+		prop, obs_module_text("Write fragmented MP4 or flush MKV clusters at the interval below so that the "
+				      "file can be played up to the last fragment even if OBS crashes."));
+	prop = obs_properties_add_int(props, "fragment_ms", obs_module_text("Fragment duration"), 100, 60000, 100);
+	obs_property_int_set_suffix(prop, " ms");
+
+	prop = obs_properties_add_list(props, "record_mode", obs_module_text("Mode"), OBS_COMBO_TYPE_LIST,
+				       OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, obs_module_text("Record while enabled"), record_continuous);
+	obs_property_list_add_int(prop, obs_module_text("Replay buffer while enabled"), record_replay);
+	obs_property_set_modified_callback(prop, record_mode_modified);
+	prop = obs_properties_add_int(props, "replay_pre_sec", obs_module_text("Replay seconds before saving"), 1,
+				      3600, 1);
+	obs_property_int_set_suffix(prop, " s");
+	prop = obs_properties_add_int(props, "replay_post_sec", obs_module_text("Replay seconds after saving"), 0,
+				      3600, 1);
+	obs_property_int_set_suffix(prop, " s");
+	obs_property_set_long_description(
+		prop, obs_module_text("The replay buffer is written to a file this time after it is requested."));
+	prop = obs_properties_add_int(props, "replay_max_mb", obs_module_text("Replay buffer maximum memory"), 16,
+				      65536, 16);
+	obs_property_int_set_suffix(prop, " MB");
+	obs_properties_add_button(props, "save_replay", obs_module_text("Save replay"), save_replay_clicked);
+
+	prop = obs_properties_add_int(props, "split_minutes", obs_module_text("Split file every"), 0, 1440, 1);
+	obs_property_int_set_suffix(prop, obs_module_text(" min"));
+	obs_property_set_long_description(prop, obs_module_text("Set 0 not to split by duration."));
+	prop = obs_properties_add_int(props, "split_mb", obs_module_text("Split file at size"), 0, 1048576, 64);
+	obs_property_int_set_suffix(prop, " MB");
+	obs_property_set_long_description(prop, obs_module_text("Set 0 not to split by size."));
 
 	obs_properties_add_bool(props, "overwrite_timestamp",
 				obs_module_text("Overwrite video timestamp with OS time"));
 
+	prop = obs_properties_add_list(props, "frame_rate_mode", obs_module_text("Frame rate"), OBS_COMBO_TYPE_LIST,
+				       OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, obs_module_text("Same as the canvas"), frame_rate_canvas);
+	obs_property_list_add_int(prop, obs_module_text("Same as the source"), frame_rate_source);
+	obs_property_set_long_description(
+		prop,
+		obs_module_text("The frame rate of the source is detected from the first frames of each recording. "
+				"This works only with OBS encoders or the replay buffer. The FFmpeg output always uses "
+				"the frame rate of the canvas."));
+
+	prop = obs_properties_add_list(props, "geometry_change", obs_module_text("When the resolution changes"),
+				       OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, obs_module_text("Start a new file"), geometry_new_file);
+	obs_property_list_add_int(prop, obs_module_text("Scale to the first resolution"), geometry_scale);
+
+	prop = obs_properties_add_bool(props, "borrow_frames", obs_module_text("Record frames without copying"));
+	obs_property_set_long_description(
+		prop, obs_module_text("The frame is held until it is recorded so that the preview and the following "
+				      "filters are delayed by the recording latency."));
+
+	prop = obs_properties_add_bool(props, "direct_output", obs_module_text("Send frames from the video thread"));
+	obs_property_set_long_description(
+		prop,
+		obs_module_text("Copy the frame to the encoder without queueing it if the record thread is idle."));
+
+	prop = obs_properties_add_int(props, "copy_threads", obs_module_text("Threads to copy large frames"), 1, 16, 1);
+
+	prop = obs_properties_add_int(props, "cache_size", obs_module_text("Video output cache size"), 0,
+				      CACHE_SIZE_MAX, 1);
+	obs_property_int_set_suffix(prop, obs_module_text(" frames"));
+	obs_property_set_long_description(prop, obs_module_text("Set 0 to decide from the memory budget below."));
+	prop = obs_properties_add_int(props, "cache_budget_mb", obs_module_text("Video output cache memory budget"),
+				      16, 4096, 16);
+	obs_property_int_set_suffix(prop, " MB");
+
+	prop = obs_properties_add_int(props, "queue_max_frames", obs_module_text("Maximum queued frames"), 0,
+				      FRAME_RING_CAPACITY, 1);
+	obs_property_set_long_description(prop, obs_module_text("Set 0 for the maximum."));
+	prop = obs_properties_add_int(props, "queue_max_mb", obs_module_text("Maximum queued size"), 0, 65536, 16);
+	obs_property_int_set_suffix(prop, " MB");
+	obs_property_set_long_description(prop, obs_module_text("Set 0 for unlimited."));
+	prop = obs_properties_add_list(props, "queue_policy", obs_module_text("When the queue is full"),
+				       OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(prop, obs_module_text("Drop oldest frame"), queue_drop_oldest);
+	obs_property_list_add_int(prop, obs_module_text("Drop newest frame"), queue_drop_newest);
+	obs_property_list_add_int(prop, obs_module_text("Wait, then drop newest frame"), queue_block);
+	prop = obs_properties_add_int(props, "queue_block_ms", obs_module_text("Maximum wait time"), 0, 1000, 1);
+	obs_property_int_set_suffix(prop, " ms");
+
+	prop = obs_properties_add_int(props, "preroll_sec", obs_module_text("Pre-roll"), 0, 60, 1);
+	obs_property_int_set_suffix(prop, " s");
+	obs_property_set_long_description(
+		prop, obs_module_text("While the filter is enabled, the frames of the last seconds are kept in memory "
+				      "until the recording is started by the button, the hotkey or the "
+				      "'start_recording' procedure, and recorded first. "
+				      "Set 0 to record whenever the filter is enabled."));
+	prop = obs_properties_add_int(props, "preroll_mb", obs_module_text("Pre-roll maximum memory"), 16, 16384, 16);
+	obs_property_int_set_suffix(prop, " MB");
+	obs_properties_add_button(props, "start_recording", obs_module_text("Start recording"),
+				  start_recording_clicked);
+	obs_properties_add_button(props, "stop_recording", obs_module_text("Stop recording"), stop_recording_clicked);
+
+	prop = obs_properties_add_int(props, "stall_restart_ms",
+				      obs_module_text("Start a new file when the source stalls longer than"), 0, 600000,
+				      100);
+	obs_property_int_set_suffix(prop, " ms");
+	obs_property_set_long_description(
+		prop, obs_module_text("The stall is not filled with duplicated frames so that the encoder does not "
+				      "spend time on a frozen picture. Set 0 to always fill the stall."));
+
+	encoder_config_add_properties(props);
+
+	if (s)
+		record_stats_add_properties(&s->stats, props);
+
 	return props;
 }
 
-static void async_record_get_defaults(obs_data_t *settings) {}
+static void async_record_get_defaults(obs_data_t *settings)
+{
+	obs_data_set_default_bool(settings, "fragmented", false);
+	obs_data_set_default_int(settings, "fragment_ms", 2000);
+	obs_data_set_default_int(settings, "record_mode", record_continuous);
+	obs_data_set_default_int(settings, "replay_pre_sec", 30);
+	obs_data_set_default_int(settings, "replay_post_sec", 10);
+	obs_data_set_default_int(settings, "replay_max_mb", 1024);
+	obs_data_set_default_int(settings, "preroll_sec", 0);
+	obs_data_set_default_int(settings, "preroll_mb", 512);
+	obs_data_set_default_int(settings, "frame_rate_mode", frame_rate_canvas);
+	obs_data_set_default_int(settings, "geometry_change", geometry_new_file);
+	obs_data_set_default_int(settings, "queue_max_frames", 120);
+	obs_data_set_default_int(settings, "queue_max_mb", 1024);
+	obs_data_set_default_int(settings, "queue_policy", queue_drop_newest);
+	obs_data_set_default_int(settings, "queue_block_ms", 10);
+	obs_data_set_default_int(settings, "copy_threads", 1);
+	obs_data_set_default_int(settings, "cache_size", 0);
+	obs_data_set_default_int(settings, "cache_budget_mb", 256);
+	encoder_config_get_defaults(settings);
+}
 
 static void async_record_destroy(void *data)
 {
@@ -413,18 +1510,34 @@ static void async_record_destroy(void *data)
 
 	pthread_mutex_lock(&s->mutex);
 	s->close = true;
-	pthread_cond_signal(&s->cond);
+	signal_thread(s);
 	pthread_mutex_unlock(&s->mutex);
 
 	pthread_join(s->thread, NULL);
 
+	if (s->replay_hotkey != OBS_INVALID_HOTKEY_ID)
+		obs_hotkey_unregister(s->replay_hotkey);
+	if (s->start_hotkey != OBS_INVALID_HOTKEY_ID)
+		obs_hotkey_unregister(s->start_hotkey);
+	if (s->stop_hotkey != OBS_INVALID_HOTKEY_ID)
+		obs_hotkey_unregister(s->stop_hotkey);
+
 	bfree(s->directory);
 	bfree(s->filename_format);
 	bfree(s->extension);
+	encoder_config_free(&s->encoder);
 	free_video_data(s);
+	frame_ring_free(&s->video_frames);
+	frame_ring_free(&s->sent_frames);
+	os_event_destroy(s->stopped_event);
+	audio_ring_free(&s->audio_frames);
+	av_sync_free(&s->av_sync);
+	frame_pool_free(&s->frame_pool);
+	frame_copy_workers_destroy(s->copy_workers);
 
 	pthread_cond_destroy(&s->cond);
 	pthread_mutex_destroy(&s->mutex);
+	pthread_mutex_destroy(&s->video_mutex);
 
 	bfree(s);
 }
@@ -443,20 +1556,87 @@ static bool get_string(char **dst, obs_data_t *settings, const char *name)
 static void async_record_update(void *data, obs_data_t *settings)
 {
 	struct async_record *s = data;
-	bool changed = false;
 
 	pthread_mutex_lock(&s->mutex);
 
-	changed |= get_string(&s->directory, settings, "directory");
-	changed |= get_string(&s->filename_format, settings, "filename_format");
-	changed |= get_string(&s->extension, settings, "extension");
-
+	// Settings read when the next file is opened, at the next split or the next recording.
+	bool next_file = false;
+	next_file |= get_string(&s->directory, settings, "directory");
+	next_file |= get_string(&s->filename_format, settings, "filename_format");
+	next_file |= get_string(&s->extension, settings, "extension");
+	bool fragmented = obs_data_get_bool(settings, "fragmented");
+	int fragment_ms = (int)obs_data_get_int(settings, "fragment_ms");
+	next_file |= fragmented != s->fragmented || fragment_ms != s->fragment_ms;
+	s->fragmented = fragmented;
+	s->fragment_ms = fragment_ms;
+	bool native = s->encoder.native;
+	bool share = s->encoder.share;
+	encoder_lossless lossless = s->encoder.lossless;
+	bool encoder_changed = encoder_config_update(&s->encoder, settings);
+	next_file |= encoder_changed;
+
+	// Settings of `video_output` or the output that cannot be applied without rebuilding them.
+	bool rebuild = false;
+	record_mode mode = (record_mode)obs_data_get_int(settings, "record_mode");
+	rebuild |= mode != s->record_mode;
+	s->record_mode = mode;
+	int replay_pre_sec = (int)obs_data_get_int(settings, "replay_pre_sec");
+	int replay_post_sec = (int)obs_data_get_int(settings, "replay_post_sec");
+	int replay_max_mb = (int)obs_data_get_int(settings, "replay_max_mb");
+	if (mode == record_replay)
+		rebuild |= replay_pre_sec != s->replay_pre_sec || replay_post_sec != s->replay_post_sec ||
+			   replay_max_mb != s->replay_max_mb;
+	s->replay_pre_sec = replay_pre_sec;
+	s->replay_post_sec = replay_post_sec;
+	s->replay_max_mb = replay_max_mb;
+	rebuild |= native != s->encoder.native || share != s->encoder.share || lossless != s->encoder.lossless;
+	// libobs encoders are kept for the whole recording, across the split files.
+	rebuild |= encoder_changed && (mode == record_replay || use_muxer(s));
+	frame_rate_mode rate_mode = (frame_rate_mode)obs_data_get_int(settings, "frame_rate_mode");
+	rebuild |= rate_mode != s->frame_rate_mode;
+	s->frame_rate_mode = rate_mode;
+
+	// The other settings are applied immediately, except the cache size that is used when `video_output` is
+	// rebuilt for another reason.
 	s->overwrite_timestamp = obs_data_get_bool(settings, "overwrite_timestamp");
+	s->geometry_change = (geometry_change_mode)obs_data_get_int(settings, "geometry_change");
+	s->borrow_frames = obs_data_get_bool(settings, "borrow_frames");
+	s->direct_output = obs_data_get_bool(settings, "direct_output");
 
-	if (changed) {
-		s->failed = false;
+	s->cache_size = (int)obs_data_get_int(settings, "cache_size");
+	s->cache_budget = (size_t)obs_data_get_int(settings, "cache_budget_mb") * 1024 * 1024;
+
+	int copy_threads = (int)obs_data_get_int(settings, "copy_threads");
+	if (copy_threads != s->copy_threads) {
+		s->copy_threads = copy_threads;
+		frame_copy_workers_set_threads(s->copy_workers, copy_threads);
+	}
+	s->queue_max_frames = (int)obs_data_get_int(settings, "queue_max_frames");
+	s->queue_max_bytes = (size_t)obs_data_get_int(settings, "queue_max_mb") * 1024 * 1024;
+	s->queue_policy = (queue_policy)obs_data_get_int(settings, "queue_policy");
+	s->queue_block_ms = (int)obs_data_get_int(settings, "queue_block_ms");
+	s->stall_restart_ns = (uint64_t)obs_data_get_int(settings, "stall_restart_ms") * 1000000;
+	s->split_ns = (uint64_t)obs_data_get_int(settings, "split_minutes") * 60 * 1000000000;
+	s->split_bytes = (uint64_t)obs_data_get_int(settings, "split_mb") * 1024 * 1024;
+
+	uint64_t preroll_ns = (uint64_t)obs_data_get_int(settings, "preroll_sec") * 1000000000;
+	s->preroll_bytes = (size_t)obs_data_get_int(settings, "preroll_mb") * 1024 * 1024;
+	if (preroll_ns != s->preroll_ns) {
+		// The audio is delayed by the pre-roll while recording so that the ring has to hold it.
+		s->preroll_ns = preroll_ns;
+		s->preroll_truncated = false;
+		if (!preroll_ns)
+			frame_pool_set_max_unused(&s->frame_pool, 0);
+		audio_ring_set_duration(&s->audio_frames, preroll_ns + AUDIO_PULL_DELAY_NS * 2);
+	}
+
+	// Set before the wakeup since the record thread checks it without `mutex` before it waits for the next frame.
+	if (rebuild)
 		s->need_restart = true;
-		pthread_cond_signal(&s->cond);
+	if (next_file || rebuild) {
+		// Retry if the previous attempt failed with the old settings.
+		s->failed = false;
+		signal_thread(s);
 	}
 
 	pthread_mutex_unlock(&s->mutex);
@@ -466,21 +1646,114 @@ static void on_enable_changed(void *data, calldata_t *cd)
 {
 	struct async_record *s = data;
 	s->enabled = calldata_bool(cd, "enabled");
+	// Enabling the filter again starts the standby, not the recording.
+	if (!s->enabled)
+		s->triggered = false;
 }
 
-static void *async_record_create(obs_data_t *settings, obs_source_t *source)
+static void proc_save_replay(void *data, calldata_t *cd)
+{
+	UNUSED_PARAMETER(cd);
+	request_replay(data);
+}
+
+static void hotkey_save_replay(void *data, obs_hotkey_id id, obs_hotkey_t *hotkey, bool pressed)
+{
+	UNUSED_PARAMETER(id);
+	UNUSED_PARAMETER(hotkey);
+	if (pressed)
+		request_replay(data);
+}
+
+static void proc_start_recording(void *data, calldata_t *cd)
+{
+	UNUSED_PARAMETER(cd);
+	set_triggered(data, true);
+}
+
+static void proc_stop_recording(void *data, calldata_t *cd)
+{
+	UNUSED_PARAMETER(cd);
+	set_triggered(data, false);
+}
+
+static void hotkey_start_recording(void *data, obs_hotkey_id id, obs_hotkey_t *hotkey, bool pressed)
+{
+	UNUSED_PARAMETER(id);
+	UNUSED_PARAMETER(hotkey);
+	if (pressed)
+		set_triggered(data, true);
+}
+
+static void hotkey_stop_recording(void *data, obs_hotkey_id id, obs_hotkey_t *hotkey, bool pressed)
+{
+	UNUSED_PARAMETER(id);
+	UNUSED_PARAMETER(hotkey);
+	if (pressed)
+		set_triggered(data, false);
+}
+
+static void proc_get_stats(void *data, calldata_t *cd)
+{
+	struct async_record *s = data;
+	record_stats_to_calldata(&s->stats, cd);
+}
+
+// Allocates and initializes the context without starting the thread.
+static struct async_record *async_record_alloc(obs_data_t *settings, obs_source_t *source)
 {
 	struct async_record *s = bzalloc(sizeof(struct async_record));
 
 	pthread_mutex_init(&s->mutex, NULL);
 	pthread_cond_init(&s->cond, NULL);
+	pthread_mutex_init(&s->video_mutex, NULL);
+	s->self = source;
+	s->replay_hotkey = OBS_INVALID_HOTKEY_ID;
+	s->start_hotkey = OBS_INVALID_HOTKEY_ID;
+	s->stop_hotkey = OBS_INVALID_HOTKEY_ID;
+	frame_ring_init(&s->video_frames);
+	frame_ring_init(&s->sent_frames);
+	os_event_init(&s->stopped_event, OS_EVENT_TYPE_MANUAL);
+	frame_pool_init(&s->frame_pool);
+	s->copy_workers = frame_copy_workers_create();
+
+	av_sync_init(&s->av_sync);
+
+	struct obs_audio_info oai = {0};
+	obs_get_audio_info(&oai);
+	s->audio_speakers = oai.speakers;
+	audio_ring_init(&s->audio_frames, get_audio_channels(oai.speakers), oai.samples_per_sec,
+			AUDIO_PULL_DELAY_NS * 2);
 
 	async_record_update(s, settings);
 
+	return s;
+}
+
+static void *async_record_create(obs_data_t *settings, obs_source_t *source)
+{
+	struct async_record *s = async_record_alloc(settings, source);
+
 	pthread_create(&s->thread, NULL, async_record_thread, s);
 
 	signal_handler_t *sh = obs_source_get_signal_handler(source);
 	signal_handler_connect(sh, "enable", on_enable_changed, s);
+
+	proc_handler_t *ph = obs_source_get_proc_handler(source);
+	proc_handler_add(ph, record_stats_proc_decl, proc_get_stats, s);
+	proc_handler_add(ph, "void save_replay()", proc_save_replay, s);
+	proc_handler_add(ph, "void start_recording()", proc_start_recording, s);
+	proc_handler_add(ph, "void stop_recording()", proc_stop_recording, s);
+
+	s->replay_hotkey = obs_hotkey_register_source(source, "async_record.save_replay",
+						      obs_module_text("Save replay of Asynchronous Source Record"),
+						      hotkey_save_replay, s);
+	s->start_hotkey = obs_hotkey_register_source(source, "async_record.start_recording",
+						     obs_module_text("Start recording of Asynchronous Source Record"),
+						     hotkey_start_recording, s);
+	s->stop_hotkey = obs_hotkey_register_source(source, "async_record.stop_recording",
+						    obs_module_text("Stop recording of Asynchronous Source Record"),
+						    hotkey_stop_recording, s);
 	s->enabled = obs_source_enabled(source);
 
 	return s;
@@ -491,38 +1764,270 @@ static void async_record_tick(void *data, float sec)
 	struct async_record *s = data;
 	UNUSED_PARAMETER(sec);
 
-	if (s->enabled != s->record) {
+	// With the pre-roll, the enabled filter stands by until the recording is triggered.
+	bool record = s->enabled && (!s->preroll_ns || s->triggered);
+	if (record != s->record) {
 		pthread_mutex_lock(&s->mutex);
-		s->record = s->enabled;
-		if (s->enabled)
-			free_video_data(s);
-		pthread_cond_signal(&s->cond);
+		s->record = record;
+		if (record) {
+			// When stopped, the record thread drains the queue before it stops the output.
+			// The frames kept for the pre-roll are recorded first.
+			if (!s->preroll_ns) {
+				free_video_data(s);
+				av_sync_reset(&s->av_sync);
+			}
+			record_stats_reset(&s->stats);
+		}
+		signal_thread(s);
 		pthread_mutex_unlock(&s->mutex);
 	}
 }
 
-static struct obs_source_frame *async_record_video(void *data, struct obs_source_frame *frame)
+// `preroll_frames` are allowed on top of the limits since the frames of the pre-roll stay queued while recording.
+static size_t queue_limit(const struct async_record *s, size_t size, size_t preroll_frames)
 {
-	struct async_record *s = data;
+	size_t limit = FRAME_RING_CAPACITY;
+	if (s->queue_max_frames > 0 && (size_t)s->queue_max_frames < limit)
+		limit = s->queue_max_frames;
+	if (s->queue_max_bytes > 0 && size > 0 && s->queue_max_bytes / size < limit)
+		limit = s->queue_max_bytes / size;
+	if (limit < 1)
+		limit = 1;
+	return preroll_frames < FRAME_RING_CAPACITY - limit ? limit + preroll_frames : FRAME_RING_CAPACITY;
+}
 
-	if (s->record && frame->width > 0 && frame->height > 0) {
-		struct obs_source_frame *copied_frame =
-			obs_source_frame_create(frame->format, frame->width, frame->height);
-		obs_source_frame_copy(copied_frame, frame);
+static void drop_frame(struct async_record *s)
+{
+	long dropped = os_atomic_inc_long(&s->stats.dropped);
+	if (!s->queue_dropping) {
+		blog(LOG_WARNING, "%p: queue is full, dropping frames (policy=%d, dropped=%ld)", s,
+		     (int)s->queue_policy, dropped);
+		s->queue_dropping = true;
+	}
+}
 
-		// Not sure this is really required.
-		if (s->overwrite_timestamp || !copied_frame->timestamp)
-			copied_frame->timestamp = obs_get_video_frame_time();
+static void wait_queue(struct async_record *s, size_t limit)
+{
+	uint64_t end_ns = os_gettime_ns() + (uint64_t)s->queue_block_ms * 1000000;
 
-		pthread_mutex_lock(&s->mutex);
-		circlebuf_push_back(&s->video_frames, &copied_frame, sizeof(copied_frame));
-		pthread_cond_signal(&s->cond);
-		pthread_mutex_unlock(&s->mutex);
+	while (frame_ring_count(&s->video_frames) >= limit && !s->close && s->record) {
+		uint64_t now = os_gettime_ns();
+		if (now >= end_ns)
+			break;
+
+		frame_ring_wait_space(&s->video_frames, limit, (unsigned long)((end_ns - now + 999999) / 1000000));
+	}
+}
+
+// Makes a room for the new frame. Returns false if the new frame should be dropped.
+static bool reserve_queue(struct async_record *s, size_t size)
+{
+	size_t limit = queue_limit(s, size, s->paced ? s->preroll_frames : 0);
+
+	if (frame_ring_count(&s->video_frames) < limit) {
+		if (s->queue_dropping) {
+			blog(LOG_INFO, "%p: queue recovered, dropped=%ld", s, os_atomic_load_long(&s->stats.dropped));
+			s->queue_dropping = false;
+		}
+		return true;
+	}
+
+	switch (s->queue_policy) {
+	case queue_drop_oldest:
+		while (frame_ring_count(&s->video_frames) >= limit) {
+			struct queued_frame qf;
+			if (!frame_ring_pop(&s->video_frames, &qf))
+				break;
+			release_queued_frame(s, &qf);
+			drop_frame(s);
+		}
+		return true;
+
+	case queue_block:
+		wait_queue(s, limit);
+		if (frame_ring_count(&s->video_frames) < limit)
+			return true;
+		drop_frame(s);
+		return false;
+
+	case queue_drop_newest:
+	default:
+		drop_frame(s);
+		return false;
+	}
+}
+
+// Returns the latest borrowed frame that has been recorded and gives the older ones back to the parent.
+static struct obs_source_frame *pop_sent_frame(struct async_record *s)
+{
+	struct queued_frame last = {0};
+	struct queued_frame qf;
+	while (frame_ring_pop(&s->sent_frames, &qf)) {
+		if (last.frame)
+			release_queued_frame(s, &last);
+		last = qf;
+	}
+	return last.frame;
+}
+
+static bool push_frame(struct async_record *s, const struct queued_frame *qf)
+{
+	if (!frame_ring_push(&s->video_frames, qf)) {
+		drop_frame(s);
+		return false;
+	}
+
+	os_atomic_inc_long(&s->stats.queued);
+	record_stats_set_queue_depth(&s->stats, frame_ring_count(&s->video_frames));
+	return true;
+}
+
+// The fields are taken from `frame`, which is the source of the copy if the queued frame is not borrowed.
+static void init_queued_frame(struct queued_frame *qf, struct obs_source_frame *frame, bool borrowed,
+			      uint64_t timestamp)
+{
+	qf->frame = frame;
+	qf->borrowed = borrowed;
+	qf->timestamp = timestamp;
+	qf->format = frame->format;
+	qf->width = frame->width;
+	qf->height = frame->height;
+	qf->full_range = frame->full_range;
+	qf->size = frame_data_size(frame);
+}
+
+// Returns true if the frame is borrowed by the record thread.
+static bool queue_frame(struct async_record *s, struct obs_source_frame *frame, uint64_t timestamp)
+{
+	if (!reserve_queue(s, frame_data_size(frame)))
+		return false;
+
+	struct queued_frame qf;
+	if (s->borrow_frames) {
+		init_queued_frame(&qf, frame, true, timestamp);
+		return push_frame(s, &qf);
 	}
 
+	init_queued_frame(&qf, frame, false, timestamp);
+	qf.frame = frame_pool_get(&s->frame_pool, frame->format, frame->width, frame->height);
+	uint64_t start_ns = os_gettime_ns();
+	frame_copy(s->copy_workers, qf.frame, frame);
+	record_stats_add_copy_time(&s->stats, os_gettime_ns() - start_ns);
+
+	if (!push_frame(s, &qf))
+		frame_pool_release(&s->frame_pool, qf.frame);
+
+	return false;
+}
+
+// Sends the frame from the video thread if nothing is queued.
+// Returns false if the record thread is busy or `video_output` has no free frame so that the frame has to be queued.
+static bool send_video_direct(struct async_record *s, struct obs_source_frame *frame, uint64_t timestamp)
+{
+	if (pthread_mutex_trylock(&s->video_mutex) != 0)
+		return false;
+
+	bool sent = false;
+	if (s->video_ready && !s->held_frame.frame && !frame_ring_count(&s->video_frames) &&
+	    frame_matches_output(s, frame) && !stalled_frames(s, timestamp))
+		sent = send_video(s, frame, timestamp);
+
+	pthread_mutex_unlock(&s->video_mutex);
+	return sent;
+}
+
+// Returns the time of the frame on the system clock.
+static uint64_t output_timestamp(struct async_record *s, const struct obs_source_frame *frame,
+				 uint64_t received_ns)
+{
+	// Not sure this is really required.
+	if (s->overwrite_timestamp || !frame->timestamp)
+		return obs_get_video_frame_time();
+
+	av_sync_observe(&s->av_sync, frame->timestamp, received_ns);
+	record_stats_set_drift(&s->stats, av_sync_drift(&s->av_sync));
+	return av_sync_to_system(&s->av_sync, frame->timestamp);
+}
+
+// Keeps the frames of the last seconds while not recording so that the recording starts with them.
+// Frames are copied into the frame pool, which reuses the frames dropped from the head of the queue.
+static void keep_preroll_frame(struct async_record *s, struct obs_source_frame *frame, uint64_t received_ns)
+{
+	uint64_t timestamp = output_timestamp(s, frame, received_ns);
+	size_t frame_size = frame_data_size(frame);
+
+	// Leave the room for the frames queued behind the pre-roll while recording, see `queue_limit`.
+	size_t live = queue_limit(s, frame_size, 0);
+	size_t max_count = live < FRAME_RING_CAPACITY / 2 ? FRAME_RING_CAPACITY - live : FRAME_RING_CAPACITY / 2;
+
+	struct queued_frame qf;
+	while (frame_ring_peek(&s->video_frames, &qf)) {
+		size_t count = frame_ring_count(&s->video_frames);
+		bool expired = timestamp < qf.timestamp || timestamp - qf.timestamp > s->preroll_ns;
+		bool full = (count + 1) * frame_size > s->preroll_bytes || count >= max_count;
+		if (!expired && !full)
+			break;
+		if (!expired && count >= max_count && !s->preroll_truncated) {
+			blog(LOG_WARNING, "%p: pre-roll is limited to %zu frames, %.3f s", s, count,
+			     (timestamp - qf.timestamp) * 1e-9);
+			s->preroll_truncated = true;
+		}
+		if (frame_ring_pop(&s->video_frames, &qf))
+			release_queued_frame(s, &qf);
+	}
+
+	init_queued_frame(&qf, frame, false, timestamp);
+	qf.frame = frame_pool_get(&s->frame_pool, frame->format, frame->width, frame->height);
+	frame_copy(s->copy_workers, qf.frame, frame);
+	if (!frame_ring_push(&s->video_frames, &qf))
+		frame_pool_release(&s->frame_pool, qf.frame);
+}
+
+// `received_ns` is the system time when the frame was received.
+static struct obs_source_frame *record_video(struct async_record *s, struct obs_source_frame *frame,
+					     uint64_t received_ns)
+{
+	struct obs_source_frame *sent_frame = pop_sent_frame(s);
+
+	if (!s->record && s->preroll_ns && frame->width > 0 && frame->height > 0)
+		keep_preroll_frame(s, frame, received_ns);
+
+	if (s->record && frame->width > 0 && frame->height > 0) {
+		os_atomic_inc_long(&s->stats.received);
+		uint64_t timestamp = output_timestamp(s, frame, received_ns);
+		bool sent = s->direct_output && send_video_direct(s, frame, timestamp);
+		if (!sent && queue_frame(s, frame, timestamp)) {
+			// The frame is borrowed by the record thread.
+			// Instead, pass the previous frame that has been recorded, if any.
+			return sent_frame;
+		}
+	}
+
+	if (sent_frame)
+		obs_source_release_frame(obs_filter_get_parent(s->self), sent_frame);
+
 	return frame;
 }
 
+static struct obs_source_frame *async_record_video(void *data, struct obs_source_frame *frame)
+{
+	return record_video(data, frame, os_gettime_ns());
+}
+
+static struct obs_audio_data *async_record_audio(void *data, struct obs_audio_data *audio)
+{
+	struct async_record *s = data;
+
+	// Audio of async sources is float planar; it is passed to the audio output without any lock.
+	// While not recording, the oldest packets are dropped instead. `audio_output` may still pull while stopping.
+	bool record = s->record;
+	if ((record || s->preroll_ns) && s->audio_frames.channels > 0)
+		audio_ring_push(&s->audio_frames, (const float *const *)audio->data, audio->frames, audio->timestamp,
+				!record);
+
+	return audio;
+}
+
 static void async_record_remove(void *data, obs_source_t *parent)
 {
 	struct async_record *s = data;
@@ -536,14 +2041,14 @@ static void async_record_remove(void *data, obs_source_t *parent)
 	s->close = true;
 	free_video_data(s);
 
-	pthread_cond_signal(&s->cond);
+	signal_thread(s);
 	pthread_mutex_unlock(&s->mutex);
 }
 
 const struct obs_source_info async_record_info = {
 	.id = "net.nagater.obs-async_record",
 	.type = OBS_SOURCE_TYPE_FILTER,
-	.output_flags = OBS_SOURCE_VIDEO | OBS_SOURCE_ASYNC,
+	.output_flags = OBS_SOURCE_VIDEO | OBS_SOURCE_AUDIO | OBS_SOURCE_ASYNC,
 	.get_name = async_record_name,
 	.create = async_record_create,
 	.destroy = async_record_destroy,
@@ -551,6 +2056,7 @@ const struct obs_source_info async_record_info = {
 	.get_properties = async_record_get_properties,
 	.get_defaults = async_record_get_defaults,
 	.filter_video = async_record_video,
+	.filter_audio = async_record_audio,
 	.video_tick = async_record_tick,
 	.filter_remove = async_record_remove,
 };